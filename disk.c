@@ -1,91 +1,1120 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+/*
+The disk is striped over one or more backing files.  Logical blocks are
+grouped into stripe units, and unit u lives on device u % ndevices as that
+device's unit u / ndevices.  A request that stays within one unit is a
+single host call from the caller's thread; a larger one is split into a
+job per device, and the devices' jobs run at once on a thread per device.
+With one device the whole disk is one unit, so nothing is ever split.
+
+A tiered disk is instead two devices end to end: a fast one holding the
+first tier_split blocks and a slow one holding the rest.  It counts every
+access to every block, for fs_migrate to decide what belongs where.
+*/
+
+#define JOB_COPYIN 2                        // device job ops besides DISK_TRACE_READ/WRITE
+
+struct piece {                              // part of a request contiguous on one device
+	char *data;                             // memory, for reads and writes
+	long long source;                       // host file offset, for copyin
+	off_t offset;                           // byte offset on the device
+	size_t length;
+};
+
+struct device {
+	int fd;
+	pthread_t thread;
+	int busy;                               // a job is waiting for the thread or running
+	int op;
+	int source;                             // host file, for copyin
+	struct piece *pieces;
+	int npieces, size;
+	long long done;                         // bytes the job moved
+};
+
+static struct device devices[DISK_MAX_DEVICES];
+static int ndevices=0;
+static int stripe=0;                        // blocks per stripe unit
+static int tier_split=0;                    // blocks on the fast tier, 0 if not tiered
+static unsigned *heat;                      // accesses to every block of a tiered disk
+static int stopping=0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;      // busy and stopping
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;  // one split request at a time
+
+/*
+Write-back queue.  disk_write parks a block in the queue rather than
+writing it, so a block written again before it goes out costs nothing
+more, and a flush writes the queue sorted by block number with every run
+of neighbouring blocks as one write.  The queue is flushed when it fills,
+when its oldest block has waited out the deadline (by the flusher thread),
+on disk_flush, and before anything reads the image behind disk.c's back.
+Reads see queued blocks.
+*/
+struct queued_block {
+	int blocknum;
+	char data[DISK_BLOCK_SIZE];
+};
+
+static struct queued_block *queue;
+static int *queue_slot;                     // slot+1 of every queued block, 0 if none
+static int *queue_order;                    // scratch for sorting a flush
+static char *queue_buffer;                  // one run of a flush
+static int queue_count=0;
+static int queue_limit=0;                   // 0 writes through
+static long long queue_deadline=0;          // ns
+static long long queue_oldest=0;            // when the queue last became non-empty
+static long long queue_absorbed=0, queue_hits=0, queue_flushes=0, queue_runs=0;
+static int queue_stopping=0;
+static pthread_t flusher;
+static int flusher_running=0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;           // on CLOCK_MONOTONIC, like stats_now
+
 static int nblocks=0;
-static int nreads=0;
+static int nreads=0;                        // blocks moved by host calls
 static int nwrites=0;
+static int nrequested[2];                   // blocks asked for through the API, [read/write]
+
+static const char *type_names[] = { "data", "superblock", "inode", "indirect" };
+
+static unsigned char *types;                // DISK_BLOCK_* of every block, as told by fs.c
+static long long type_count[2][4];          // [read/write][type]
+static struct stats_hist latency[2];        // per host I/O call
+
+static struct disk_trace *ring;             // optional record of every I/O, oldest overwritten
+static int ring_size=0;
+static long long ring_count=0;
+static FILE *trace_file;                    // optional record of every I/O and fs call, kept in full
+static long long epoch=0;                   // trace times count from disk_init
+
+// reads and writes may come from several threads; only the bookkeeping needs guarding
+static pthread_mutex_t account_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void * device_thread( void *arg );
+static void * flusher_thread( void *arg );
+static int map_block( int blocknum, off_t *offset, int *run );
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_striped(filename,DISK_STRIPE_DEFAULT,n);
+}
+
+/*
+Open the comma separated list of backing files as one disk of n blocks,
+striped in units of stripe_blocks.  The same list and stripe must be given
+every time an image is opened.  Unless mode is DISK_OPEN_CREATE the files
+must already hold n blocks; they are left as they are and written through.
+*/
+static int open_disk( const char *filenames, int stripe_blocks, int nfast, int n, int mode )
+{
+	char *list = strdup(filenames), *name, *save;
+	int flags = mode==DISK_OPEN_CREATE ? O_RDWR|O_CREAT : mode==DISK_OPEN_READONLY ? O_RDONLY : O_RDWR;
+	struct stat st;
+	off_t size;
+	int d, units, bad;
+
+	ndevices = 0;
+	for(name=strtok_r(list,",",&save);name;name=strtok_r(0,",",&save)) {
+		if(ndevices==DISK_MAX_DEVICES) {
+			errno = EINVAL;
+			break;
+		}
+		devices[ndevices].fd = open(name,flags,0666);
+		if(devices[ndevices].fd<0) break;
+		ndevices++;
+	}
+	free(list);
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	bad = ndevices==0 || stripe_blocks<1 || n<0 || (nfast && (ndevices!=2 || nfast<0 || nfast>=n));
+	if(name || bad) {
+		if(!name && ndevices) errno = EINVAL;
+		else if(!name) errno = ENOENT;
+		while(ndevices>0) close(devices[--ndevices].fd);
+		return 0;
+	}
+
+	tier_split = nfast;
+	stripe = ndevices==1 || tier_split ? (n>0 ? n : 1) : stripe_blocks;
+	units = (n+stripe-1)/stripe;
+
+	for(d=0;d<ndevices;d++) {
+		if(tier_split) size = (off_t)(d==0 ? tier_split : n-tier_split)*DISK_BLOCK_SIZE;
+		else size = (off_t)((units+ndevices-1)/ndevices)*stripe*DISK_BLOCK_SIZE;
+		if(mode==DISK_OPEN_CREATE) ftruncate(devices[d].fd,size);
+		else if(fstat(devices[d].fd,&st)<0 || st.st_size<size) break;
+	}
+
+	if(d<ndevices) {
+		errno = EFBIG; // n blocks don't fit in what is there
+		while(ndevices>0) close(devices[--ndevices].fd);
+		tier_split = 0;
+		return 0;
+	}
+
+	for(d=0;d<ndevices;d++) {
+		devices[d].busy = 0;
+		devices[d].npieces = 0;
+		if(d>0) pthread_create(&devices[d].thread,0,device_thread,&devices[d]);
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nrequested[DISK_TRACE_READ] = nrequested[DISK_TRACE_WRITE] = 0;
+
+	epoch = stats_now();
+
+	free(types);
+	types = calloc(n,1);
+	free(heat);
+	heat = tier_split ? calloc(n,sizeof(*heat)) : 0;
+	memset(type_count,0,sizeof(type_count));
+	memset(latency,0,sizeof(latency));
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&queue_cond,&attr);
+	pthread_condattr_destroy(&attr);
+
+	free(queue_slot);
+	queue_slot = calloc(n,sizeof(int));
+	queue_count = 0;
+	queue_stopping = 0;
+	queue_absorbed = queue_hits = queue_flushes = queue_runs = 0;
+	if(mode==DISK_OPEN_CREATE) {
+		disk_set_writeback(DISK_QUEUE_BLOCKS,DISK_QUEUE_DEADLINE);
+		pthread_create(&flusher,0,flusher_thread,0);
+		flusher_running = 1;
+	} else {
+		disk_set_writeback(0,0);
+	}
 
 	return 1;
 }
 
+int disk_init_striped( const char *filenames, int stripe_blocks, int n )
+{
+	return open_disk(filenames,stripe_blocks,0,n,DISK_OPEN_CREATE);
+}
+
+/*
+Open the comma separated pair "fast,slow" as one disk of n blocks, the
+first nfast of them on the fast file.
+*/
+int disk_init_tiered( const char *filenames, int nfast, int n )
+{
+	if(nfast<1) {
+		errno = EINVAL;
+		return 0;
+	}
+	return open_disk(filenames,1,nfast,n,DISK_OPEN_CREATE);
+}
+
+/*
+Open an image that must already exist, striped or (with nfast) tiered as
+for disk_init_striped and disk_init_tiered.  Nothing is created or resized
+and no write is held back, which is what a checker wants.
+*/
+int disk_open( const char *filenames, int stripe_blocks, int nfast, int n, int mode )
+{
+	if(nfast<0 || mode==DISK_OPEN_CREATE) {
+		errno = EINVAL;
+		return 0;
+	}
+	return open_disk(filenames,nfast ? 1 : stripe_blocks,nfast,n,mode);
+}
+
+int disk_tier_blocks()
+{
+	return tier_split;
+}
+
+/*
+Every block the caller asked for, whether or not it meant a host call: a
+write may sit in the queue and be folded into a later one, and a read may
+be served from the queue.  Tiered disks also count each block's heat.
+*/
+static void requested( int op, int blocknum, int n )
+{
+	int i;
+
+	__atomic_fetch_add(&nrequested[op],n,__ATOMIC_RELAXED);
+
+	if(!heat) return;
+	for(i=0;i<n;i++) __atomic_fetch_add(&heat[blocknum+i],1,__ATOMIC_RELAXED);
+}
+
+int disk_heat( int blocknum )
+{
+	if(!heat || blocknum<0 || blocknum>=nblocks) return 0;
+	return heat[blocknum];
+}
+
+void disk_heat_move( int from, int to ) // a block's contents moved, and its heat goes with them
+{
+	if(!heat || from<0 || from>=nblocks || to<0 || to>=nblocks) return;
+	heat[to] = heat[from];
+	heat[from] = 0;
+}
+
+void disk_heat_decay() // halve every count, so heat follows recent use
+{
+	int i;
+
+	if(!heat) return;
+	for(i=0;i<nblocks;i++) heat[i] >>= 1;
+}
+
+void disk_set_type( int blocknum, int n, int type )
+{
+	if(blocknum>=0 && n>0 && blocknum+n<=nblocks) memset(types+blocknum,type,n);
+}
+
+static void trace_add( const struct disk_trace *t )
+{
+	if(ring) ring[ring_count++ % ring_size] = *t;
+	if(trace_file) fwrite(t,sizeof(*t),1,trace_file);
+}
+
+/*
+Count n blocks of I/O at blocknum and, when start is not negative, the
+latency of the host call that began at start.
+*/
+static void account( int op, int blocknum, int n, long long start )
+{
+	long long now = start<0 ? 0 : stats_now();
+	int i;
+
+	pthread_mutex_lock(&account_lock);
+
+	if(op==DISK_TRACE_READ) nreads += n;
+	else nwrites += n;
+
+	for(i=0;i<n;i++) type_count[op][types[blocknum+i]]++;
+
+	if(start>=0) stats_record(&latency[op],now-start);
+
+	if(ring || trace_file) {
+		struct disk_trace t;
+		memset(&t,0,sizeof(t));
+		t.time = (start<0 ? stats_now() : start) - epoch;
+		t.latency = start<0 ? 0 : now-start;
+		t.op = op;
+		t.type = types[blocknum];
+		t.blocknum = blocknum;
+		t.nblocks = n;
+		trace_add(&t);
+	}
+
+	pthread_mutex_unlock(&account_lock);
+}
+
+void disk_trace_call( int op, long long start, int inumber, int offset, int length, int result, const char *name )
+{
+	struct disk_trace t;
+
+	if(!ring && !trace_file) return;
+
+	memset(&t,0,sizeof(t));
+	t.time = start-epoch;
+	t.latency = stats_now()-start;
+	t.op = op;
+	t.blocknum = inumber;
+	t.nblocks = length;
+	t.offset = offset;
+	t.result = result;
+	if(name) strncpy(t.name,name,sizeof(t.name)-1);
+
+	pthread_mutex_lock(&account_lock);
+	trace_add(&t);
+	pthread_mutex_unlock(&account_lock);
+}
+
 int disk_size()
 {
 	return nblocks;
 }
 
+/*
+Give up on the process.  The write-back queue holds blocks the caller was
+told are written, so they go straight to the devices first, one pwrite
+each and without the locks, which the caller may be holding; and whatever
+stdout buffered goes out too.
+*/
+static void fatal()
+{
+	static int dying = 0;
+	off_t offset;
+	int run, i, d;
+
+	fflush(stdout);
+
+	if(!dying++) {
+		for(i=0;i<queue_count;i++) {
+			d = map_block(queue[i].blocknum,&offset,&run);
+			if(pwrite(devices[d].fd,queue[i].data,DISK_BLOCK_SIZE,offset)!=DISK_BLOCK_SIZE) break;
+		}
+	}
+
+	abort();
+}
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
-		abort();
+		fatal();
 	}
 
 	if(blocknum>=nblocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
-		abort();
+		fatal();
 	}
 
 	if(!data) {
 		printf("ERROR: null data pointer!\n");
-		abort();
+		fatal();
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static void extent_check( int blocknum, long long length )
+{
+	if(blocknum<0 || length<0 || blocknum+(length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE>nblocks) {
+		printf("ERROR: extent of %lld bytes at block %d is out of range!\n",length,blocknum);
+		fatal();
+	}
+}
+
+static void io_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	fatal();
+}
+
+/*
+Device holding blocknum, the block's byte offset on it, and in *run how
+many blocks from blocknum on stay in the same stripe unit.
+*/
+static int map_block( int blocknum, off_t *offset, int *run )
 {
+	int unit = blocknum/stripe;
+	int within = blocknum%stripe;
+
+	if(tier_split) {
+		int slow = blocknum>=tier_split;
+		*offset = (off_t)(blocknum-slow*tier_split)*DISK_BLOCK_SIZE;
+		*run = (slow ? nblocks : tier_split)-blocknum;
+		return slow;
+	}
+
+	*offset = ((off_t)(unit/ndevices)*stripe+within)*DISK_BLOCK_SIZE;
+	*run = stripe-within;
+
+	return unit%ndevices;
+}
+
+/*
+Move length bytes between a host file and the run of blocks starting at
+blocknum without bouncing them through user space.  copy_file_range only
+works between regular files, so pipes and terminals fall back to sendfile
+(copyout) and finally to an ordinary read/write loop.
+*/
+static long long copy_in_piece( int fd, long long offset, int devfd, off_t out, long long length )
+{
+	off_t in = offset, to = out;
+	long long done = 0;
+	ssize_t result;
+	char buffer[65536];
+
+	while(done<length) {
+		result = copy_file_range(fd,&in,devfd,&to,length-done,0);
+		if(result<=0) break;
+		done += result;
+	}
+
+	while(done<length) {
+		result = pread(fd,buffer,length-done<(long long)sizeof(buffer) ? length-done : sizeof(buffer),offset+done);
+		if(result<=0) break;
+		if(pwrite(devfd,buffer,result,out+done)!=result) io_error();
+		done += result;
+	}
+
+	return done;
+}
+
+static long long copy_out_piece( int devfd, off_t in, int fd, long long length )
+{
+	long long done = 0;
+	ssize_t result;
+	char buffer[65536];
+
+	while(done<length) {
+		result = copy_file_range(devfd,&in,fd,0,length-done,0);
+		if(result<=0) break;
+		done += result;
+	}
+
+	while(done<length) {
+		result = sendfile(fd,devfd,&in,length-done);
+		if(result<=0) break;
+		done += result;
+	}
+
+	while(done<length) {
+		result = pread(devfd,buffer,length-done<(long long)sizeof(buffer) ? length-done : sizeof(buffer),in);
+		if(result<=0) break;
+		if(write(fd,buffer,result)!=result) break;
+		in += result;
+		done += result;
+	}
+
+	return done;
+}
+
+/*
+Break length bytes at blocknum into pieces on each device's job.  data is
+the memory of a read or write, or null for a copyin from source on.
+*/
+static void split( int blocknum, long long length, char *data, long long source )
+{
+	struct device *dev;
+	struct piece *last;
+	long long done = 0, bytes;
+	off_t offset;
+	int d, run;
+
+	for(d=0;d<ndevices;d++) devices[d].npieces = 0;
+
+	while(done<length) {
+		dev = &devices[map_block(blocknum+done/DISK_BLOCK_SIZE,&offset,&run)];
+		bytes = (long long)run*DISK_BLOCK_SIZE;
+		if(bytes>length-done) bytes = length-done;
+
+		if(dev->npieces==dev->size) {
+			dev->size = dev->size ? dev->size*2 : 64;
+			dev->pieces = realloc(dev->pieces,sizeof(struct piece)*dev->size);
+		}
+
+		last = &dev->pieces[dev->npieces++];
+		last->data = data ? data+done : 0;
+		last->source = source+done;
+		last->offset = offset;
+		last->length = bytes;
+
+		done += bytes;
+	}
+}
+
+/*
+Run one device's job.  Reads and writes gather the pieces that follow on
+from each other on the device into a single vectored call.
+*/
+static void run_job( struct device *dev )
+{
+	struct iovec iov[64];
+	struct piece *p;
+	ssize_t total, result;
+	int i, k;
+
+	dev->done = 0;
+
+	for(i=0;i<dev->npieces;i+=k) {
+		p = &dev->pieces[i];
+
+		if(dev->op==JOB_COPYIN) {
+			dev->done += copy_in_piece(dev->source,p->source,dev->fd,p->offset,p->length);
+			k = 1;
+			continue;
+		}
+
+		total = 0;
+		for(k=0;i+k<dev->npieces && k<64;k++) {
+			if(k>0 && p[k].offset!=p[k-1].offset+(off_t)p[k-1].length) break;
+			iov[k].iov_base = p[k].data;
+			iov[k].iov_len = p[k].length;
+			total += p[k].length;
+		}
+
+		if(dev->op==DISK_TRACE_READ) result = preadv(dev->fd,iov,k,p->offset);
+		else result = pwritev(dev->fd,iov,k,p->offset);
+
+		if(result!=total) io_error();
+		dev->done += result;
+	}
+}
+
+static void * device_thread( void *arg )
+{
+	struct device *dev = arg;
+
+	pthread_mutex_lock(&pool_lock);
+	while(1) {
+		while(!dev->busy && !stopping) pthread_cond_wait(&pool_work,&pool_lock);
+		if(!dev->busy) break;
+
+		pthread_mutex_unlock(&pool_lock);
+		run_job(dev);
+		pthread_mutex_lock(&pool_lock);
+
+		dev->busy = 0;
+		pthread_cond_broadcast(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return 0;
+}
+
+/*
+Run the jobs split() made, device 0's on this thread and the others on
+their own, and wait for all of them.  Returns the bytes moved.  The
+caller holds dispatch_lock.
+*/
+static long long run_jobs( int op, int source )
+{
+	long long done = 0;
+	int d;
+
+	pthread_mutex_lock(&pool_lock);
+	for(d=0;d<ndevices;d++) {
+		devices[d].op = op;
+		devices[d].source = source;
+		devices[d].done = 0;
+		if(d>0 && devices[d].npieces) devices[d].busy = 1;
+	}
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	if(devices[0].npieces) run_job(&devices[0]);
+
+	pthread_mutex_lock(&pool_lock);
+	for(d=1;d<ndevices;d++) {
+		while(devices[d].busy) pthread_cond_wait(&pool_done,&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	for(d=0;d<ndevices;d++) done += devices[d].done;
+	return done;
+}
+
+static void device_io( int op, int blocknum, int n, char *data )
+{
+	ssize_t length = (ssize_t)n*DISK_BLOCK_SIZE, result;
+	off_t offset;
+	int run, d;
+
+	d = map_block(blocknum,&offset,&run);
+
+	if(run>=n) {
+		if(op==DISK_TRACE_READ) result = pread(devices[d].fd,data,length,offset);
+		else result = pwrite(devices[d].fd,data,length,offset);
+	} else {
+		pthread_mutex_lock(&dispatch_lock);
+		split(blocknum,length,data,0);
+		result = run_jobs(op,-1);
+		pthread_mutex_unlock(&dispatch_lock);
+	}
+
+	if(result!=length) io_error();
+}
+
+static void block_io( int op, int blocknum, int n, char *data )
+{
+	long long start = stats_now();
+
 	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	device_io(op,blocknum,n,data);
+
+	account(op,blocknum,n,start);
+}
+
+static int compare_blocks( const void *a, const void *b )
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// the caller holds queue_lock, here and below
+static void flush_queue()
+{
+	long long start;
+	int i, j, k;
+
+	if(!queue_count) return;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	for(i=0;i<queue_count;i++) queue_order[i] = queue[i].blocknum;
+	qsort(queue_order,queue_count,sizeof(int),compare_blocks);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	for(i=0;i<queue_count;i=j) {
+		for(j=i+1;j<queue_count && queue_order[j]==queue_order[j-1]+1;j++);
+
+		for(k=i;k<j;k++) {
+			memcpy(queue_buffer+(k-i)*DISK_BLOCK_SIZE,queue[queue_slot[queue_order[k]]-1].data,DISK_BLOCK_SIZE);
+		}
+
+		start = stats_now();
+		device_io(DISK_TRACE_WRITE,queue_order[i],j-i,queue_buffer);
+		account(DISK_TRACE_WRITE,queue_order[i],j-i,start);
+		queue_runs++;
+	}
+
+	for(i=0;i<queue_count;i++) queue_slot[queue[i].blocknum] = 0;
+	queue_count = 0;
+	queue_flushes++;
+}
+
+static int queued_in( int blocknum, int n )
+{
+	int i;
+
+	if(n>queue_count) {
+		for(i=0;i<queue_count;i++) {
+			if(queue[i].blocknum>=blocknum && queue[i].blocknum<blocknum+n) return 1;
+		}
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		for(i=0;i<n;i++) {
+			if(queue_slot[blocknum+i]) return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void unqueue( int blocknum, int n ) // about to be overwritten in place
+{
+	int i;
+
+	for(i=0;i<queue_count;) {
+		if(queue[i].blocknum<blocknum || queue[i].blocknum>=blocknum+n) {
+			i++;
+			continue;
+		}
+		queue_slot[queue[i].blocknum] = 0;
+		if(i!=--queue_count) {
+			queue[i] = queue[queue_count];
+			queue_slot[queue[i].blocknum] = i+1;
+		}
 	}
 }
 
+static void * flusher_thread( void *arg )
+{
+	struct timespec ts;
+	long long when;
+
+	pthread_mutex_lock(&queue_lock);
+	while(!queue_stopping) {
+		if(!queue_count) {
+			pthread_cond_wait(&queue_cond,&queue_lock);
+			continue;
+		}
+
+		when = queue_oldest+queue_deadline;
+		if(stats_now()>=when) {
+			flush_queue();
+			continue;
+		}
+
+		ts.tv_sec = when/1000000000;
+		ts.tv_nsec = when%1000000000;
+		pthread_cond_timedwait(&queue_cond,&queue_lock,&ts);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+/*
+Queue up to blocks writes, none for longer than ms milliseconds.  Zero
+blocks makes disk_write write through.
+*/
+void disk_set_writeback( int blocks, int ms )
+{
+	pthread_mutex_lock(&queue_lock);
+
+	flush_queue();
+
+	queue_limit = blocks>0 ? blocks : 0;
+	queue_deadline = (long long)ms*1000000;
+	free(queue);
+	free(queue_order);
+	free(queue_buffer);
+	queue = malloc(sizeof(*queue)*(queue_limit+1));
+	queue_order = malloc(sizeof(int)*(queue_limit+1));
+	queue_buffer = malloc((size_t)DISK_BLOCK_SIZE*(queue_limit+1));
+
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void disk_flush()
+{
+	pthread_mutex_lock(&queue_lock);
+	flush_queue();
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void disk_read( int blocknum, char *data )
+{
+	disk_read_extent(blocknum,1,data);
+}
+
+void disk_read_extent( int blocknum, int n, char *data )
+{
+	int i, slot;
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+	requested(DISK_TRACE_READ,blocknum,n);
+
+	if(__atomic_load_n(&queue_count,__ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&queue_lock);
+		if(queued_in(blocknum,n)) {
+			// hold the lock so the flusher can't write the queued blocks out under the read
+			if(n>1 || !queue_slot[blocknum]) block_io(DISK_TRACE_READ,blocknum,n,data);
+			for(i=0;i<n;i++) {
+				if((slot = queue_slot[blocknum+i])) {
+					memcpy(data+i*DISK_BLOCK_SIZE,queue[slot-1].data,DISK_BLOCK_SIZE);
+					queue_hits++;
+				}
+			}
+			pthread_mutex_unlock(&queue_lock);
+			return;
+		}
+		pthread_mutex_unlock(&queue_lock);
+	}
+
+	block_io(DISK_TRACE_READ,blocknum,n,data);
+}
+
 void disk_write( int blocknum, const char *data )
 {
+	int slot;
+
 	sanity_check(blocknum,data);
+	requested(DISK_TRACE_WRITE,blocknum,1);
+
+	pthread_mutex_lock(&queue_lock);
+
+	if(!queue_limit) {
+		pthread_mutex_unlock(&queue_lock);
+		block_io(DISK_TRACE_WRITE,blocknum,1,(char*)data);
+		return;
+	}
+
+	if((slot = queue_slot[blocknum])) {
+		memcpy(queue[slot-1].data,data,DISK_BLOCK_SIZE);
+		queue_absorbed++;
+	} else {
+		if(!queue_count) {
+			queue_oldest = stats_now();
+			pthread_cond_signal(&queue_cond);
+		}
+		queue[queue_count].blocknum = blocknum;
+		memcpy(queue[queue_count].data,data,DISK_BLOCK_SIZE);
+		queue_slot[blocknum] = ++queue_count;
+		if(queue_count>=queue_limit) flush_queue();
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void disk_write_extent( int blocknum, int n, const char *data )
+{
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+	requested(DISK_TRACE_WRITE,blocknum,n);
+
+	pthread_mutex_lock(&queue_lock);
+	unqueue(blocknum,n);
+	pthread_mutex_unlock(&queue_lock);
+
+	block_io(DISK_TRACE_WRITE,blocknum,n,(char*)data);
+}
+
+long long disk_copyin( int blocknum, int fd, long long offset, long long length )
+{
+	long long done, start = stats_now();
+	off_t out;
+	int run, d;
+
+	extent_check(blocknum,length);
+	requested(DISK_TRACE_WRITE,blocknum,(length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+
+	pthread_mutex_lock(&queue_lock);
+	unqueue(blocknum,(length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&queue_lock);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	d = map_block(blocknum,&out,&run);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if((long long)run*DISK_BLOCK_SIZE>=length) {
+		done = copy_in_piece(fd,offset,devices[d].fd,out,length);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		pthread_mutex_lock(&dispatch_lock);
+		split(blocknum,length,0,offset);
+		done = run_jobs(JOB_COPYIN,fd);
+		pthread_mutex_unlock(&dispatch_lock);
+	}
+
+	if(done) account(DISK_TRACE_WRITE,blocknum,(done+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE,start);
+
+	return done;
+}
+
+/*
+The destination of a copyout may be a pipe, so its pieces go out one after
+another, each in the largest run one device holds.
+*/
+long long disk_copyout( int blocknum, int fd, long long length )
+{
+	long long done = 0, bytes, result, start = stats_now();
+	off_t in;
+	int run, d;
+
+	extent_check(blocknum,length);
+	requested(DISK_TRACE_READ,blocknum,(length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+
+	pthread_mutex_lock(&queue_lock);
+	if(queued_in(blocknum,(length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE)) flush_queue();
+	pthread_mutex_unlock(&queue_lock);
+
+	while(done<length) {
+		d = map_block(blocknum+done/DISK_BLOCK_SIZE,&in,&run);
+		bytes = (long long)run*DISK_BLOCK_SIZE;
+		if(bytes>length-done) bytes = length-done;
+
+		result = copy_out_piece(devices[d].fd,in,fd,bytes);
+		done += result;
+		if(result<bytes) break;
 	}
+
+	if(done) account(DISK_TRACE_READ,blocknum,(done+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE,start);
+
+	return done;
+}
+
+/*
+Host file and byte offset holding the *n blocks at blocknum, for callers
+that want to splice straight out of the image.  *n is cut down to what
+one device holds in a row.
+*/
+int disk_extent_fd( int blocknum, int *n, long long *offset )
+{
+	off_t in;
+	int run, d;
+
+	extent_check(blocknum,(long long)*n*DISK_BLOCK_SIZE);
+	requested(DISK_TRACE_READ,blocknum,*n);
+
+	pthread_mutex_lock(&queue_lock);
+	if(queued_in(blocknum,*n)) flush_queue();
+	pthread_mutex_unlock(&queue_lock);
+
+	d = map_block(blocknum,&in,&run);
+	if(*n>run) *n = run;
+
+	*offset = in;
+	account(DISK_TRACE_READ,blocknum,*n,-1); // the caller does the actual read
+
+	return devices[d].fd;
+}
+
+int disk_nreads()
+{
+	return nreads;
+}
+
+int disk_nwrites()
+{
+	return nwrites;
+}
+
+int disk_nrequested()
+{
+	return __atomic_load_n(&nrequested[DISK_TRACE_READ],__ATOMIC_RELAXED) + __atomic_load_n(&nrequested[DISK_TRACE_WRITE],__ATOMIC_RELAXED);
+}
+
+void disk_stats()
+{
+	int t;
+
+	printf("disk: %d blocks, %d reads, %d writes\n",nblocks,nreads,nwrites);
+	printf("    requested %d reads %d writes\n",nrequested[DISK_TRACE_READ],nrequested[DISK_TRACE_WRITE]);
+	if(ndevices>1) {
+		printf("    striped over %d devices, %d blocks per stripe unit\n",ndevices,stripe);
+	}
+	if(tier_split) {
+		printf("    tiered: blocks 0-%d fast, %d-%d slow\n",tier_split-1,tier_split,nblocks-1);
+	}
+	if(queue_limit) {
+		printf("    write queue holds %d of %d blocks, %lld ms deadline\n",queue_count,queue_limit,queue_deadline/1000000);
+		printf("    %lld writes absorbed, %lld reads hit the queue, %lld flushes in %lld runs\n",queue_absorbed,queue_hits,queue_flushes,queue_runs);
+	}
+	for(t=0;t<4;t++) {
+		printf("    %-10s %lld reads %lld writes\n",type_names[t],type_count[DISK_TRACE_READ][t],type_count[DISK_TRACE_WRITE][t]);
+	}
+	printf("    host calls %lld reads %lld writes\n",latency[DISK_TRACE_READ].count,latency[DISK_TRACE_WRITE].count);
+	stats_print("read",&latency[DISK_TRACE_READ]);
+	stats_print("write",&latency[DISK_TRACE_WRITE]);
+	if(ring) {
+		printf("    trace      %lld records (ring holds %d)\n",ring_count,ring_size);
+	}
+	if(trace_file) {
+		printf("    trace      recording to file\n");
+	}
+}
+
+/*
+The ring and the trace file are only touched under account_lock: the
+flusher thread records its writes through account() at any moment.
+disk_trace_start returns the ring's size, or 0 if it has none.
+*/
+int disk_trace_start( int nrecords )
+{
+	if(nrecords<1) return 0;
+
+	pthread_mutex_lock(&account_lock);
+	free(ring);
+	ring = calloc(nrecords,sizeof(*ring));
+	ring_size = ring ? nrecords : 0;
+	ring_count = 0;
+	pthread_mutex_unlock(&account_lock);
+
+	return ring_size;
+}
+
+void disk_trace_stop()
+{
+	pthread_mutex_lock(&account_lock);
+	free(ring);
+	ring = 0;
+	ring_size = 0;
+
+	if(trace_file) {
+		fclose(trace_file);
+		trace_file = 0;
+	}
+	pthread_mutex_unlock(&account_lock);
+}
+
+static void trace_header( FILE *file )
+{
+	struct disk_trace_header header;
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,DISK_TRACE_MAGIC,sizeof(header.magic));
+	header.version = DISK_TRACE_VERSION;
+	header.record_size = sizeof(struct disk_trace);
+	header.nblocks = nblocks;
+	fwrite(&header,sizeof(header),1,file);
+}
+
+/*
+Stream every record from now on to filename.  A trace file is a struct
+disk_trace_header followed by raw struct disk_trace, the input of fsreplay.
+*/
+int disk_trace_open( const char *filename )
+{
+	int ok;
+
+	pthread_mutex_lock(&account_lock);
+	if(trace_file) fclose(trace_file);
+
+	trace_file = fopen(filename,"w");
+	ok = trace_file!=0;
+	if(ok) trace_header(trace_file);
+	pthread_mutex_unlock(&account_lock);
+
+	return ok;
+}
+
+/*
+Write the ring out as a trace file, oldest record first.  Returns the
+number of records written or -1.
+*/
+int disk_trace_dump( const char *filename )
+{
+	FILE *file;
+	long long first, i, count;
+
+	pthread_mutex_lock(&account_lock);
+
+	file = ring ? fopen(filename,"w") : 0;
+	if(!file) {
+		pthread_mutex_unlock(&account_lock);
+		return -1;
+	}
+
+	trace_header(file);
+	first = ring_count>ring_size ? ring_count-ring_size : 0;
+	for(i=first;i<ring_count;i++) {
+		fwrite(&ring[i % ring_size],sizeof(*ring),1,file);
+	}
+	count = ring_count-first;
+
+	pthread_mutex_unlock(&account_lock);
+
+	fclose(file);
+	return count;
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	int d;
+
+	if(ndevices>0) {
+		pthread_mutex_lock(&queue_lock);
+		flush_queue();
+		queue_stopping = 1;
+		pthread_cond_signal(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
+		if(flusher_running) pthread_join(flusher,0);
+		flusher_running = 0;
+	}
+
+	disk_trace_stop();
+
+	if(ndevices>0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+
+		pthread_mutex_lock(&pool_lock);
+		stopping = 1;
+		pthread_cond_broadcast(&pool_work);
+		pthread_mutex_unlock(&pool_lock);
+
+		for(d=0;d<ndevices;d++) {
+			if(d>0) pthread_join(devices[d].thread,0);
+			close(devices[d].fd);
+			free(devices[d].pieces);
+			devices[d].pieces = 0;
+			devices[d].size = 0;
+		}
+
+		ndevices = 0;
+		stopping = 0;
+		tier_split = 0;
 	}
 }
 
@@ -3,10 +3,84 @@
 
 #define DISK_BLOCK_SIZE 4096
 
+#define DISK_MAX_DEVICES      16 // backing files a disk may be striped over
+#define DISK_STRIPE_DEFAULT   16 // blocks per stripe unit
+#define DISK_QUEUE_BLOCKS     256 // writes held back before a flush
+#define DISK_QUEUE_DEADLINE   50 // ms a write may be held back
+
+#define DISK_BLOCK_DATA       0 // block types, for disk_set_type
+#define DISK_BLOCK_SUPER      1
+#define DISK_BLOCK_INODE      2
+#define DISK_BLOCK_INDIRECT   3
+
+#define DISK_TRACE_READ       0
+#define DISK_TRACE_WRITE      1
+#define DISK_TRACE_FS         16 // fs calls are DISK_TRACE_FS + FS_OP_*
+
+#define DISK_TRACE_MAGIC      "SFSTRACE"
+#define DISK_TRACE_VERSION    2
+#define DISK_TRACE_NAME       28 // a directory entry name and its terminator
+
+struct disk_trace_header {
+	char magic[8];
+	int version;
+	int record_size;
+	int nblocks;            // size of the traced disk
+	int unused;
+};
+
+struct disk_trace {
+	long long time;         // ns since disk_init
+	long long latency;      // ns spent in the host I/O or fs call
+	int op;                 // DISK_TRACE_READ, DISK_TRACE_WRITE or DISK_TRACE_FS + FS_OP_*
+	int type;               // DISK_BLOCK_* of the first block
+	int blocknum;           // first block, or the inumber of an fs call
+	int nblocks;            // blocks, or the length passed to an fs call
+	int offset;             // fs calls only; the inumber linked, for fs_linkat
+	int result;             // fs calls only
+	char name[DISK_TRACE_NAME]; // directory calls only, whose inumber is the directory
+};
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_striped( const char *filenames, int stripe, int nblocks );
+int  disk_init_tiered( const char *filenames, int nfast, int nblocks );
+
+#define DISK_OPEN_CREATE      0 // as disk_init does: create and size the files
+#define DISK_OPEN_EXISTING    1
+#define DISK_OPEN_READONLY    2
+
+int  disk_open( const char *filenames, int stripe, int nfast, int nblocks, int mode );
+
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_extent( int blocknum, int n, char *data );
+void disk_write_extent( int blocknum, int n, const char *data );
+void disk_set_writeback( int blocks, int ms );
+void disk_flush();
+
+long long disk_copyin( int blocknum, int fd, long long offset, long long length );
+long long disk_copyout( int blocknum, int fd, long long length );
+int  disk_extent_fd( int blocknum, int *n, long long *offset );
+
+void disk_set_type( int blocknum, int n, int type );
+
+int  disk_tier_blocks();
+int  disk_heat( int blocknum );
+void disk_heat_move( int from, int to );
+void disk_heat_decay();
+
+int  disk_nreads();
+int  disk_nwrites();
+int  disk_nrequested();
+void disk_stats();
+
+int  disk_trace_start( int nrecords );
+int  disk_trace_open( const char *filename );
+void disk_trace_stop();
+int  disk_trace_dump( const char *filename );
+void disk_trace_call( int op, long long start, int inumber, int offset, int length, int result, const char *name );
+
 void disk_close();
 
 
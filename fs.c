@@ -1,5 +1,7 @@
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
+#include "fs_layout.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,47 +10,68 @@
 #include <unistd.h>
 #include <math.h>
 
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
+#define MAX_OPEN_FILES     64
 
-struct fs_superblock {
-	int magic;
-	int nblocks;
-	int ninodeblocks;
-	int ninodes;
+struct fs_node {                 // an open inode, shared by every descriptor on it
+    int inumber;
+    int type;                    // FS_INODE_FILE or FS_INODE_DIR, 0 once deleted
+    int size;
+    int nblocks;                 // how many entries of blocks[] are resolved
+    int refs;                    // descriptors open on it
+    int blocks[MAX_FILE_BLOCKS]; // data block numbers, in file order
 };
 
-struct fs_inode {
-	int isvalid;
-	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+struct fs_file {
+    int inumber;
+    int offset;                  // current position
+    struct fs_node *node;
 };
 
-union fs_block {
-	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
+struct fs_opstats {
+    const char *name;
+    long long calls;
+    long long bytes;
+    long long blocks;            // disk blocks read or written on behalf of the call
+    struct stats_hist latency;
+};
+
+static struct fs_opstats opstats[FS_NUM_OPS] = {
+    { "mount" }, { "create" }, { "delete" }, { "mkdir" }, { "link" },
+    { "unlink" }, { "lookup" }, { "truncate" }, { "sync" }, { "read" },
+    { "write" }, { "fread" }, { "fwrite" }, { "copyin" }, { "copyout" },
 };
 
 int MOUNTED = 0;
 int *bitmap;
+struct fs_superblock super; // copy of the superblock while mounted
+struct fs_file *files[MAX_OPEN_FILES];
+struct fs_node *nodes[MAX_OPEN_FILES]; // never more nodes than descriptors
+static unsigned char *named; // files some directory entry names, found on first use
 
-int nextOpen() //look for the next free block using the FBB
+static int freeExtents;      // runs of free blocks in the FBB
+static int largestFree = -1; // longest of them, -1 until fs_statfs looks again
+
+static void markBlock( int b, int used ) // set one bit of the FBB, keeping the free counts
+{
+    int before = b > 0 && !bitmap[b - 1];
+    int after = b + 1 < disk_size() && !bitmap[b + 1];
+
+    bitmap[b] = used;
+    super.nfree += used ? -1 : 1;
+    freeExtents += (used ? -1 : 1) * (1 - before - after); // a run is split, joined, made or used up
+    largestFree = -1;
+}
+
+static int nextOpenIn( int from, int to ) // first free block in [from, to)
 {
     int i;
 
-    for (i = 0; i < disk_size(); i++)
+    for (i = from; i < to; i++)
     {
         if (bitmap[i] == 0)
         {
-            union fs_block block;
-            disk_read(0, block.data);
             int openBlock = i;
-            bitmap[i] = 1;
+            markBlock(i, 1);
             return openBlock;
         }
     }
@@ -56,6 +79,30 @@ int nextOpen() //look for the next free block using the FBB
     return -1;
 }
 
+int nextOpen() //look for the next free block using the FBB
+{
+    return nextOpenIn(0, disk_size());
+}
+
+void freeBlock( int b ) // hand a block back to the FBB
+{
+    if (b > 0 && b < disk_size() && bitmap[b])
+    {
+        markBlock(b, 0);
+        disk_set_type(b, 1, DISK_BLOCK_DATA);
+    }
+}
+
+void dirInit( union fs_block *header ) // header of an empty directory whose only bucket is file block 1
+{
+    memset(header->data, 0, sizeof(header->data));
+    header->dir.magic = FS_DIR_MAGIC;
+    header->dir.depth = 0;
+    header->dir.nbuckets = 1;
+    header->dir.nentries = 0;
+    header->dir.table[0] = 1;
+}
+
 int fs_format()
 {
     if (MOUNTED)
@@ -72,14 +119,26 @@ int fs_format()
         inodes = 1;
     }
 
+    if (disk_tier_blocks() && disk_tier_blocks() < inodes + 1)
+    {
+        printf("fs_format Error: the fast tier must hold the superblock and %d inode blocks\n", inodes);
+        return 0;
+    }
+
     union fs_block sb;
 
+    memset(sb.data, 0, sizeof(sb.data));
     sb.super.magic = FS_MAGIC; //set the data for the suberblock
     sb.super.nblocks = diskSize;
     sb.super.ninodeblocks = inodes;
     sb.super.ninodes = INODES_PER_BLOCK*inodes;
+    sb.super.root = inodes + 2 < diskSize ? sb.super.ninodes - 1 : 0; // room for the root directory's two blocks?
+    sb.super.nfree = diskSize - 1 - inodes - (sb.super.root ? 2 : 0);
+    sb.super.nfreeinodes = (INODES_PER_BLOCK - 1) * inodes - (sb.super.root ? 1 : 0); // slot 0 of each block goes unused
 
     disk_write(0, sb.data);
+    disk_set_type(0, 1, DISK_BLOCK_SUPER);
+    disk_set_type(1, inodes, DISK_BLOCK_INODE);
 
     int i, j, k;
 
@@ -97,9 +156,26 @@ int fs_format()
             }
             block.inode[j].indirect = 0;
         }
+        if (i == inodes && sb.super.root) // root directory is the last inode, so fs_create still starts at 1
+        {                                   // header and bucket go right after the inode blocks
+            int r = INODES_PER_BLOCK - 1;
+            block.inode[r].isvalid = FS_INODE_DIR;
+            block.inode[r].size = 2 * DISK_BLOCK_SIZE;
+            block.inode[r].direct[0] = inodes + 1;
+            block.inode[r].direct[1] = inodes + 2;
+        }
         disk_write(i, block.data);
     }
 
+    if (sb.super.root)
+    {
+        union fs_block dir;
+        dirInit(&dir);
+        disk_write(inodes + 1, dir.data);
+        memset(dir.data, 0, sizeof(dir.data));
+        disk_write(inodes + 2, dir.data);
+    }
+
     return 1;
 }
 
@@ -137,7 +213,7 @@ void fs_debug()
             if (block.inode[j].isvalid && currInodes < inodes)
             {
                 currInodes++;
-                printf("Inode %d: valid\n", j);
+                printf("Inode %d: %s\n", j, block.inode[j].isvalid == FS_INODE_DIR ? "directory" : "valid");
                 printf("     size: %d bytes\n", block.inode[j].size);
                 if (block.inode[j].size > 0)
                 {
@@ -177,7 +253,7 @@ void fs_debug()
     }
 }
 
-int fs_mount()
+static int doMount()
 {
     if (MOUNTED == 1)
     {
@@ -200,6 +276,7 @@ int fs_mount()
     bitmap = malloc(sizeof(int)*diskSize);
 
     int i, j, k;
+    int rootOk = 0, freeInodes = 0;
 
     for (i = 0; i < disk_size(); i++) // initialize all to 0
     {
@@ -207,6 +284,8 @@ int fs_mount()
     }
 
     bitmap[0] = 1; // superblock to 1
+    disk_set_type(0, 1, DISK_BLOCK_SUPER);
+    disk_set_type(1, sbTest.super.ninodeblocks, DISK_BLOCK_INODE);
 
     for (i = 0; i <= sbTest.super.ninodeblocks; i++) // inodes to 1
     {
@@ -218,6 +297,14 @@ int fs_mount()
         disk_read(i, block.data);
         for (j = 0; j < INODES_PER_BLOCK; j++)
         {
+            if (block.inode[j].isvalid == FS_INODE_DIR && (i-1)*INODES_PER_BLOCK + j == sbTest.super.root)
+            {
+                rootOk = 1;
+            }
+            if (block.inode[j].isvalid == 0 && j > 0)
+            {
+                freeInodes++;
+            }
             if (block.inode[j].isvalid != 0) // see if direct and indirect blocks in use, if so, set their bitmap to 1
             {
                 int nBlocks = ceil(block.inode[j].size / (double)4096);
@@ -242,6 +329,8 @@ int fs_mount()
                     {
                         bitmap[block.inode[j].direct[k]] = 1;
                     }
+                    bitmap[block.inode[j].indirect] = 1;
+                    disk_set_type(block.inode[j].indirect, 1, DISK_BLOCK_INDIRECT);
                     disk_write(i, block.data);
                     union fs_block indir;
                     disk_read(block.inode[j].indirect, indir.data);
@@ -259,11 +348,31 @@ int fs_mount()
         }
     }
 
+    super = sbTest.super;
+    if (!rootOk)
+    {
+        super.root = 0; // older image, the root directory is made on first use
+    }
+
+    // the saved counts may be stale, or missing on older images: recount
+    super.nfree = 0;
+    super.nfreeinodes = freeInodes;
+    freeExtents = 0;
+    largestFree = -1;
+    for (i = 1; i < diskSize; i++)
+    {
+        if (!bitmap[i])
+        {
+            super.nfree++;
+            freeExtents += bitmap[i - 1];
+        }
+    }
+
     MOUNTED = 1;
 	return 1;
 }
 
-int fs_create()
+static int doCreate()
 {
 
     if (!MOUNTED)
@@ -286,8 +395,11 @@ int fs_create()
         {
             if (curr.inode[j].isvalid == 0)
             {
-                curr.inode[j].isvalid = 1;
+                curr.inode[j].isvalid = FS_INODE_FILE;
                 curr.inode[j].size = 0;
+                memset(curr.inode[j].direct, 0, sizeof(curr.inode[j].direct)); // a freed slot keeps its old pointers
+                curr.inode[j].indirect = 0;
+                super.nfreeinodes--;
                 disk_write(0, block.data); // save changes
                 disk_write(i, curr.data);
                 return (i-1)*INODES_PER_BLOCK + j; // return position of inode
@@ -298,45 +410,62 @@ int fs_create()
 	return 0;
 }
 
-int fs_delete( int inumber )
+static int doSync() // everything written so far reaches the image, and the free counts the superblock
 {
-    if (inumber < 1)
+    if (MOUNTED)
     {
-        printf("fs_delete Error: invalid inode number\n");
-        return 0;
-    }
-
-    int index = 1 + inumber / INODES_PER_BLOCK;
-
-    union fs_block block;
+        union fs_block block;
 
-    disk_read(index, block.data);
+        disk_read(0, block.data);
+        block.super.nfree = super.nfree;
+        block.super.nfreeinodes = super.nfreeinodes;
+        disk_write(0, block.data);
+    }
 
-    index = index % INODES_PER_BLOCK;
+    disk_flush();
+    return 1;
+}
 
-    if (block.inode[index].isvalid == 0)
+/*
+How full the image is, from the counts the allocator and fs_create and
+fs_delete keep up to date, so asking costs no disk I/O.  Only the longest
+free run needs a pass over the FBB, and only after blocks came or went.
+*/
+int fs_statfs( struct fs_statfs *st )
+{
+    if (!MOUNTED)
     {
+        printf("fs_statfs Error: no filesystem mounted\n");
         return 0;
     }
 
-    block.inode[index].isvalid = 0;
-    block.inode[index].size = 0;
-
-    int i;
+    int i, len = 0;
 
-    for (i = 0; i < POINTERS_PER_INODE; i++)
+    if (largestFree < 0)
     {
-        block.inode[index].direct[i] = 0;
+        largestFree = 0;
+        for (i = 1; i < disk_size(); i++)
+        {
+            len = bitmap[i] ? 0 : len + 1;
+            if (len > largestFree)
+            {
+                largestFree = len;
+            }
+        }
     }
 
-    block.inode[index].indirect = 0;
-
-	return 1;
+    st->nblocks = super.nblocks;
+    st->nfree = super.nfree;
+    st->ninodes = super.ninodes - super.ninodeblocks;
+    st->nfreeinodes = super.nfreeinodes;
+    st->freeExtents = freeExtents;
+    st->largestFree = largestFree;
+    return 1;
 }
 
 int fs_getsize( int inumber )
 {
-    if (inumber < 1)
+    if (inumber < 1 || inumber >= fs_ninodes())
     {
         printf("fs_getsize Error: invalid inode number\n");
         return -1;
@@ -348,7 +477,7 @@ int fs_getsize( int inumber )
 
     disk_read(index, block.data);
 
-    index = index % INODES_PER_BLOCK;
+    index = inumber % INODES_PER_BLOCK;
 
     if (block.inode[index].isvalid == 0)
     {
@@ -359,264 +488,2155 @@ int fs_getsize( int inumber )
 
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+int fs_ninodes()
 {
-
-    if (inumber < 1)
-    {
-        printf("fs_read Error: invalid inode number\n");
-        return -1;
-    }
-
-    if (!MOUNTED)
+    if (MOUNTED)
     {
-        printf("fs_read Error: no filesystem mounted\n");
-        return -1;
+        return super.ninodes;
     }
 
-    int index = 1 + inumber / INODES_PER_BLOCK;  // block to read
-
     union fs_block block;
 
-    disk_read(index, block.data);   // read in block that has inode
+    disk_read(0, block.data);
+
+    if (block.super.magic != FS_MAGIC)
+    {
+        return 0;
+    }
 
-    index = inumber % INODES_PER_BLOCK;          // get inode from inode block
+    return block.super.ninodes;
+}
 
-    if (length > block.inode[index].size - offset) //don't read over size
+int fs_isvalid( int inumber )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
     {
-        length = block.inode[index].size - offset;
+        return 0;
     }
 
-    int curr = ceil(offset / (double)4096); // which block to start at
+    union fs_block block;
 
-    int tmpOff = offset % 4096;     // what index to start at
+    disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
 
-    int currData = 0;               // amount we've copied
+    return block.inode[inumber % INODES_PER_BLOCK].isvalid != 0;
+}
 
-    int i;
+/*
+Resolve the first n data blocks of an inode into blocks[].  With alloc set,
+holes (and the indirect block) are filled from the free block bitmap and the
+indirect block is written back; the caller writes back the inode itself.
+Returns how many blocks were resolved, stopping early at a hole or when the
+disk is full.
+*/
+static int inode_map( struct fs_inode *inode, int *blocks, int n, int alloc )
+{
+    union fs_block indir;
+    int i, dirty = 0;
 
-    while (currData < length)
+    if (alloc && n > POINTERS_PER_INODE && inode->indirect == 0 && inode->direct[0] == 0) // new file: indirect block first, as defrag lays it out
     {
-        union fs_block copyBlock;
-        if (curr < POINTERS_PER_INODE)      // if we are still in direct blocks
+        if ((inode->indirect = nextOpen()) < 1)
         {
-            if (block.inode[index].direct[curr] == 0)
-            {
-                return currData;
-            }
+            inode->indirect = 0;
+            return 0;
+        }
+        memset(indir.data, 0, sizeof(indir.data));
+        disk_set_type(inode->indirect, 1, DISK_BLOCK_INDIRECT);
+        dirty = 1;
+    }
 
-            disk_read(block.inode[index].direct[curr], copyBlock.data); // readin direct block
-            for (i = tmpOff; i < 4096; i++)
+    for (i = 0; i < n && i < POINTERS_PER_INODE; i++)
+    {
+        if (inode->direct[i] == 0)
+        {
+            if (!alloc || (inode->direct[i] = nextOpen()) < 1)
             {
-                if (currData == length)
+                inode->direct[i] = 0;
+                if (dirty) // allocated up front, but nothing will point through it
                 {
-                    return currData; // return if all data read in
+                    freeBlock(inode->indirect);
+                    inode->indirect = 0;
                 }
-                data[currData] = copyBlock.data[i]; // copy data
-                currData++;
+                return i;
             }
-            tmpOff = 0;
-            curr++;
         }
-        else if (curr >= POINTERS_PER_INODE)    // going into indirect blocks
+        blocks[i] = inode->direct[i];
+    }
+
+    if (i == n)
+    {
+        return n;
+    }
+
+    if (inode->indirect == 0)
+    {
+        if (!alloc || (inode->indirect = nextOpen()) < 1)
+        {
+            inode->indirect = 0;
+            return i;
+        }
+        memset(indir.data, 0, sizeof(indir.data));
+        disk_set_type(inode->indirect, 1, DISK_BLOCK_INDIRECT);
+        dirty = 1;
+    }
+    else if (!dirty)
+    {
+        disk_read(inode->indirect, indir.data);
+    }
+
+    for (; i < n && i < MAX_FILE_BLOCKS; i++)
+    {
+        int *pointer = &indir.pointers[i - POINTERS_PER_INODE];
+        if (*pointer == 0)
         {
-            disk_read(block.inode[index].indirect, copyBlock.data);
-            int j = curr % POINTERS_PER_INODE;
-            while (copyBlock.pointers[j] > 0)
+            if (!alloc || (*pointer = nextOpen()) < 1)
             {
-                union fs_block indir;
-                disk_read(copyBlock.pointers[j], indir.data);
-
-                for (i = tmpOff; i < 4096; i++)
-                {
-                    if (currData == length)
-                    {
-                        return currData; // return if all data read in
-                    }
-                    data[currData] = indir.data[i];
-                    currData++;
-                }
-                tmpOff = 0;
-                j++;
+                *pointer = 0;
+                break;
             }
-            curr++;
-            return currData;
+            dirty = 1;
         }
+        blocks[i] = *pointer;
     }
 
-    return currData;
+    if (dirty)
+    {
+        disk_write(inode->indirect, indir.data);
+    }
+
+    return i;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+static int extent_length( const int *blocks, int i, int n ) // how many blocks from i on are contiguous on disk
 {
-    if (inumber < 1)
+    int j = i + 1;
+
+    while (j < n && blocks[j] == blocks[j-1] + 1)
     {
-        printf("fs_write Error: invalid inode number\n");
-        return 0;
+        j++;
+    }
+
+    return j - i;
+}
+
+/*
+An open inode has one node holding its size and block map, shared by all
+the descriptors on it, so a write through one is seen by the others.
+Calls that change an inode behind the descriptors' back reload its node.
+*/
+static struct fs_node *findNode( int inumber )
+{
+    int n;
+
+    for (n = 0; n < MAX_OPEN_FILES; n++)
+    {
+        if (nodes[n] && nodes[n]->inumber == inumber)
+        {
+            return nodes[n];
+        }
+    }
+
+    return 0;
+}
+
+static void nodeLoad( struct fs_node *node, struct fs_inode *inode )
+{
+    node->type = inode->isvalid;
+    node->size = inode->isvalid ? inode->size : 0;
+    node->nblocks = inode->isvalid ? inode_map(inode, node->blocks, (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, 0) : 0;
+}
+
+static void dropNode( struct fs_node *node ) // last descriptor on it closed
+{
+    int n;
+
+    for (n = 0; n < MAX_OPEN_FILES; n++)
+    {
+        if (nodes[n] == node)
+        {
+            nodes[n] = 0;
+        }
+    }
+
+    free(node);
+}
+
+static void nodeReload( int inumber, struct fs_inode *inode ) // the inode changed underneath any open descriptors
+{
+    struct fs_node *node = findNode(inumber);
+
+    if (node)
+    {
+        nodeLoad(node, inode);
+    }
+}
+
+static int doCopyin( int inumber, int fd, int length )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        printf("fs_copyin Error: invalid inode number\n");
+        return -1;
     }
 
     if (!MOUNTED)
     {
-        printf("fs_write Error: filesystem not mounted\n");
-        return 0;
+        printf("fs_copyin Error: filesystem not mounted\n");
+        return -1;
     }
 
-    int origBlock = 1 + inumber / INODES_PER_BLOCK;  // block to write to
+    int origBlock = 1 + inumber / INODES_PER_BLOCK;
+    int index = inumber % INODES_PER_BLOCK;
 
     union fs_block block;
 
-    disk_read(origBlock, block.data);   // read in block that has inode
+    disk_read(origBlock, block.data);
 
-    int index = inumber % INODES_PER_BLOCK;          // get inode from inode block
+    if (block.inode[index].isvalid == 0)
+    {
+        printf("fs_copyin Error: inode not valid\n");
+        return -1;
+    }
 
-    if (block.inode[index].isvalid == 0)        // if inode is not valid
+    if (block.inode[index].isvalid == FS_INODE_DIR)
     {
-        printf("fs_write Error: inode not valid\n");
-        return 0;
+        printf("fs_copyin Error: inode %d is a directory\n", inumber);
+        return -1;
+    }
+
+    int maxLength = MAX_FILE_BLOCKS * DISK_BLOCK_SIZE;
+
+    if (length > maxLength)
+    {
+        printf("fs_copyin Error: file too large, truncating to %d bytes\n", maxLength);
+        length = maxLength;
     }
 
-    int curr = ceil(offset / 4096); // which pointer to start at
+    int nBlocks = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int *blocks = malloc(sizeof(int) * (nBlocks + 1));
+
+    int got = inode_map(&block.inode[index], blocks, nBlocks, 1); // allocate everything up front
+    if (got < nBlocks)
+    {
+        printf("fs_copyin Error: No more open blocks\n");
+        length = got * DISK_BLOCK_SIZE;
+    }
 
-    int tmpOff = offset % 4096;     // what bytes to start at
+    int i = 0, copied = 0;
 
-    int toCopy = length;            // amount we still need to write
+    while (i < got) // one transfer per contiguous run of blocks
+    {
+        int run = extent_length(blocks, i, got);
+        int bytes = run * DISK_BLOCK_SIZE;
 
-    int overLap = block.inode[index].size - length; // bytes of data that will be overwritten
+        if (bytes > length - copied)
+        {
+            bytes = length - copied;
+        }
 
-    int newSize = block.inode[index].size;          // size of stuff writen, only grows when writing new data
+        long long result = disk_copyin(blocks[i], fd, copied, bytes);
+        copied += result;
+        if (result != bytes)
+        {
+            break;
+        }
+        i += run;
+    }
 
-    if (offset > newSize)
+    if (copied > block.inode[index].size) // only what arrived: a short copy must not expose stale blocks
     {
-        newSize = offset; // in case we are writing past the current data
+        block.inode[index].size = copied;
     }
+    disk_write(origBlock, block.data);
+    nodeReload(inumber, &block.inode[index]);
 
-    int currData = 0;               // amount we've writen
+    free(blocks);
+    return copied;
+}
 
-    int i;
-    while (toCopy > 0)
+static int doCopyout( int inumber, int fd )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
     {
-        union fs_block writeBlock;
-        if (curr < POINTERS_PER_INODE)      // if we are still in direct blocks
-        {
-            if (block.inode[index].direct[curr] == 0) // no if direct block, find next open block 
-            {
-                block.inode[index].direct[curr] = nextOpen();
+        printf("fs_copyout Error: invalid inode number\n");
+        return -1;
+    }
 
-                if (block.inode[index].direct[curr] < 1)
-                {
-                    printf("fs_write Error: No more open blocks\n");
-                    return currData;
-                }
-            }
+    if (!MOUNTED)
+    {
+        printf("fs_copyout Error: no filesystem mounted\n");
+        return -1;
+    }
 
-            disk_read(block.inode[index].direct[curr], writeBlock.data); // read in direct pointer
-            for (i = tmpOff; i < 4096; i++)
-            {
-                if (toCopy == 0) // if we are finished writing...
-                {
-                    disk_write(block.inode[index].direct[curr], writeBlock.data);
-                    block.inode[index].size = newSize;
-                    disk_write(origBlock, block.data);
-                    return currData;
-                }
+    int index = inumber % INODES_PER_BLOCK;
 
-                if (overLap <= 0) // if we are done overwriting data and now writing new data
-                {
-                    newSize++;
-                }
-                writeBlock.data[i] = data[currData];
-                toCopy--;
-                currData++;
-                overLap--;
-            }
-            disk_write(block.inode[index].direct[curr], writeBlock.data);
-            disk_write(origBlock, block.data);
-            tmpOff = 0;
-            curr++;
-        }
-        else if (curr >= POINTERS_PER_INODE) // if we are in the indirect blocks
-        {
-            if (block.inode[index].indirect == 0)
-            { // if no indirect block set yet...
-                block.inode[index].indirect = nextOpen();
-                disk_read(block.inode[index].indirect, writeBlock.data);
-                int g;
-                for (g = 0; g < POINTERS_PER_BLOCK; g++)
-                { // initialize pointers to 0
-                    writeBlock.pointers[g] = 0;
-                }
-            }
-            else 
-            {
-                disk_read(block.inode[index].indirect, writeBlock.data);
-            }
+    union fs_block block;
 
-            if (block.inode[index].indirect <= 0)
-            {
-                block.inode[index].indirect = 0;
-                block.inode[index].size = newSize;
-                disk_write(origBlock, block.data);
-                printf("fs_write Error: No more open blocks\n");
-                return currData;
-            }
-        
-            int j = curr % POINTERS_PER_INODE;
-                // find current block
-            while (toCopy > 0)
-            {
-                union fs_block indir;
-                if (writeBlock.pointers[j] == 0)
-                { // if indirect pointer not set to block....
-                    writeBlock.pointers[j] = nextOpen();
-                    if (writeBlock.pointers[j] <= 0)
-                    {
-                        writeBlock.pointers[j] = 0;
-                        block.inode[index].size = newSize;
-                        disk_write(block.inode[index].indirect, writeBlock.data);
-                        disk_write(origBlock, block.data);
-                        printf("fs_write Error: no more open blocks\n");
-                        return currData;
-                    }
-                }
-                disk_read(writeBlock.pointers[j], indir.data);
+    disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
 
-                for (i = tmpOff; i < 4096; i++)
-                {
-                    if (toCopy == 0) // if done writing....
-                    {
-                        block.inode[index].size = newSize;
-                        disk_write(writeBlock.pointers[j], indir.data);
-                        disk_write(block.inode[index].indirect, writeBlock.data);
-                        disk_write(origBlock, block.data);
-                        return currData;
-                    }
+    if (block.inode[index].isvalid == 0)
+    {
+        printf("fs_copyout Error: inode not valid\n");
+        return -1;
+    }
 
-                    if (overLap <= 0)
-                    {
-                        newSize++;
-                    }
-                    indir.data[i] = data[currData];
-                    toCopy--;
-                    currData++;
-                    overLap--;
-                }
+    int length = block.inode[index].size;
+    int nBlocks = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int *blocks = malloc(sizeof(int) * (nBlocks + 1));
 
-                disk_write(writeBlock.pointers[j], indir.data);
-                disk_write(block.inode[index].indirect, writeBlock.data);
-                tmpOff = 0;
-                j++;
-            }
-            curr++;
-            return currData;
+    int got = inode_map(&block.inode[index], blocks, nBlocks, 0);
+    if (got < nBlocks)
+    {
+        length = got * DISK_BLOCK_SIZE; // stop at the first hole
+    }
+
+    int i = 0, copied = 0;
+
+    while (i < got)
+    {
+        int run = extent_length(blocks, i, got);
+        int bytes = run * DISK_BLOCK_SIZE;
+
+        if (bytes > length - copied)
+        {
+            bytes = length - copied;
+        }
+
+        long long result = disk_copyout(blocks[i], fd, bytes);
+        copied += result;
+        if (result != bytes)
+        {
+            break;
         }
+        i += run;
     }
 
-    return currData;
+    free(blocks);
+    return copied;
 }
 
+/*
+Open files keep the inode's block map and a position, so a sequence of
+fs_fread/fs_fwrite calls only touches the inode again when the file grows.
+Runs of contiguous full blocks go to the disk in a single request.
+*/
+int fs_open( int inumber )
+{
+    if (!MOUNTED)
+    {
+        printf("fs_open Error: no filesystem mounted\n");
+        return -1;
+    }
 
+    if (inumber < 1 || inumber >= super.ninodes)
+    {
+        printf("fs_open Error: invalid inode number\n");
+        return -1;
+    }
 
+    int fd;
+    for (fd = 0; fd < MAX_OPEN_FILES && files[fd]; fd++);
 
+    if (fd == MAX_OPEN_FILES)
+    {
+        printf("fs_open Error: too many open files\n");
+        return -1;
+    }
 
+    struct fs_node *node = findNode(inumber);
 
+    if (!node)
+    {
+        union fs_block block;
 
+        disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
+
+        int n;
+        for (n = 0; nodes[n]; n++);
+
+        node = malloc(sizeof(*node));
+        node->inumber = inumber;
+        node->refs = 0;
+        nodeLoad(node, &block.inode[inumber % INODES_PER_BLOCK]);
+        nodes[n] = node;
+    }
+
+    if (node->type == 0)
+    {
+        printf("fs_open Error: inode not valid\n");
+        if (node->refs == 0)
+        {
+            dropNode(node);
+        }
+        return -1;
+    }
+
+    struct fs_file *file = malloc(sizeof(*file));
+
+    file->inumber = inumber;
+    file->offset = 0;
+    file->node = node;
+    node->refs++;
+
+    files[fd] = file;
+    return fd;
+}
+
+int fs_close( int fd )
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd])
+    {
+        printf("fs_close Error: bad file descriptor\n");
+        return 0;
+    }
+
+    struct fs_node *node = files[fd]->node;
+
+    free(files[fd]);
+    files[fd] = 0;
+
+    if (--node->refs == 0)
+    {
+        dropNode(node);
+    }
+    return 1;
+}
+
+int fs_seek( int fd, int offset )
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd] || offset < 0)
+    {
+        printf("fs_seek Error: bad file descriptor or offset\n");
+        return -1;
+    }
+
+    files[fd]->offset = offset;
+    return offset;
+}
+
+int fs_fextent( int fd, int fileBlock, int *blocknum ) // how many blocks from fileBlock on are contiguous on disk
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd])
+    {
+        printf("fs_fextent Error: bad file descriptor\n");
+        return 0;
+    }
+
+    struct fs_node *node = files[fd]->node;
+
+    if (fileBlock < 0 || fileBlock >= node->nblocks)
+    {
+        return 0;
+    }
+
+    *blocknum = node->blocks[fileBlock];
+    return extent_length(node->blocks, fileBlock, node->nblocks);
+}
+
+static int fileRead( int fd, char *data, int length )
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd])
+    {
+        printf("fs_fread Error: bad file descriptor\n");
+        return -1;
+    }
+
+    struct fs_file *file = files[fd];
+    struct fs_node *node = file->node;
+
+    if (length > node->size - file->offset) //don't read over size
+    {
+        length = node->size - file->offset;
+    }
+
+    int pos = file->offset;
+    int currData = 0;
+
+    while (currData < length)
+    {
+        int curr = pos / DISK_BLOCK_SIZE;
+        int tmpOff = pos % DISK_BLOCK_SIZE;
+
+        if (curr >= node->nblocks) // hole, nothing more to read
+        {
+            break;
+        }
+
+        if (tmpOff == 0 && length - currData >= DISK_BLOCK_SIZE)
+        {
+            int run = extent_length(node->blocks, curr, node->nblocks);
+            if (run > (length - currData) / DISK_BLOCK_SIZE)
+            {
+                run = (length - currData) / DISK_BLOCK_SIZE;
+            }
+            disk_read_extent(node->blocks[curr], run, data + currData);
+            currData += run * DISK_BLOCK_SIZE;
+            pos += run * DISK_BLOCK_SIZE;
+        }
+        else // partial block at either end
+        {
+            union fs_block copyBlock;
+            int bytes = DISK_BLOCK_SIZE - tmpOff;
+            if (bytes > length - currData)
+            {
+                bytes = length - currData;
+            }
+            disk_read(node->blocks[curr], copyBlock.data);
+            memcpy(data + currData, copyBlock.data + tmpOff, bytes);
+            currData += bytes;
+            pos += bytes;
+        }
+    }
+
+    file->offset = pos;
+    return currData;
+}
+
+/*
+Past the end of a file its blocks hold whatever they held before, perhaps
+another file's data, so every byte from the old end up to where a write
+starts, and what the write leaves of its last block, is zeroed.
+*/
+static void zeroRange( struct fs_node *node, int from, int to )
+{
+    union fs_block block;
+    int pos, curr, off, bytes;
+
+    for (pos = from; pos < to; pos += bytes)
+    {
+        curr = pos / DISK_BLOCK_SIZE;
+        off = pos % DISK_BLOCK_SIZE;
+        bytes = DISK_BLOCK_SIZE - off < to - pos ? DISK_BLOCK_SIZE - off : to - pos;
+
+        if (curr >= node->nblocks)
+        {
+            break;
+        }
+
+        if (bytes < DISK_BLOCK_SIZE)
+        {
+            disk_read(node->blocks[curr], block.data);
+        }
+        memset(block.data + off, 0, bytes);
+        disk_write(node->blocks[curr], block.data);
+    }
+}
+
+static int fileGrow( struct fs_node *node, int end ) // allocate up to end and record the new size; returns how far it got
+{
+    int nBlocks = (end + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int origBlock = 1 + node->inumber / INODES_PER_BLOCK;
+    union fs_block block;
+    struct fs_inode *inode = &block.inode[node->inumber % INODES_PER_BLOCK];
+
+    disk_read(origBlock, block.data);
+
+    if (nBlocks > node->nblocks)
+    {
+        node->nblocks = inode_map(inode, node->blocks, nBlocks, 1);
+        if (node->nblocks < nBlocks)
+        {
+            printf("fs Error: No more open blocks\n");
+            end = node->nblocks * DISK_BLOCK_SIZE;
+        }
+    }
+
+    if (end > node->size)
+    {
+        node->size = end;
+    }
+    inode->size = node->size;
+
+    disk_write(origBlock, block.data);
+    return end;
+}
+
+static int fileWrite( int fd, const char *data, int length )
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd])
+    {
+        printf("fs_fwrite Error: bad file descriptor\n");
+        return -1;
+    }
+
+    struct fs_file *file = files[fd];
+    struct fs_node *node = file->node;
+
+    if (node->type == 0)
+    {
+        printf("fs_fwrite Error: inode not valid\n");
+        return -1;
+    }
+
+    if (length > MAX_FILE_BLOCKS * DISK_BLOCK_SIZE - file->offset)
+    {
+        printf("fs_fwrite Error: file too large\n");
+        length = MAX_FILE_BLOCKS * DISK_BLOCK_SIZE - file->offset;
+        if (length < 0)
+        {
+            length = 0;
+        }
+    }
+
+    int oldSize = node->size;
+    int end = file->offset + length;
+    int nBlocks = (end + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+    if (nBlocks > node->nblocks || end > node->size) // the inode only changes when the file grows
+    {
+        end = fileGrow(node, end);
+        if (end < file->offset)
+        {
+            end = file->offset;
+        }
+        length = end - file->offset;
+    }
+
+    if (file->offset - file->offset % DISK_BLOCK_SIZE > oldSize) // whole blocks of gap; the write's first block is done below
+    {
+        zeroRange(node, oldSize, file->offset - file->offset % DISK_BLOCK_SIZE);
+    }
+
+    int pos = file->offset;
+    int currData = 0;
+
+    while (currData < length)
+    {
+        int curr = pos / DISK_BLOCK_SIZE;
+        int tmpOff = pos % DISK_BLOCK_SIZE;
+
+        if (tmpOff == 0 && length - currData >= DISK_BLOCK_SIZE)
+        {
+            int run = extent_length(node->blocks, curr, node->nblocks);
+            if (run > (length - currData) / DISK_BLOCK_SIZE)
+            {
+                run = (length - currData) / DISK_BLOCK_SIZE;
+            }
+            disk_write_extent(node->blocks[curr], run, data + currData);
+            currData += run * DISK_BLOCK_SIZE;
+            pos += run * DISK_BLOCK_SIZE;
+        }
+        else // read-modify-write of a partial block
+        {
+            union fs_block writeBlock;
+            int base = curr * DISK_BLOCK_SIZE;
+            int keep = oldSize - base; // bytes of the block that belong to the file already
+            int bytes = DISK_BLOCK_SIZE - tmpOff;
+            if (bytes > length - currData)
+            {
+                bytes = length - currData;
+            }
+            if (keep > 0)
+            {
+                disk_read(node->blocks[curr], writeBlock.data);
+            }
+            if (keep < DISK_BLOCK_SIZE)
+            {
+                keep = keep > 0 ? keep : 0;
+                memset(writeBlock.data + keep, 0, DISK_BLOCK_SIZE - keep);
+            }
+            memcpy(writeBlock.data + tmpOff, data + currData, bytes);
+            disk_write(node->blocks[curr], writeBlock.data);
+            currData += bytes;
+            pos += bytes;
+        }
+    }
+
+    file->offset = pos;
+    return currData;
+}
+
+static int doRead( int inumber, char *data, int length, int offset )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        printf("fs_read Error: invalid inode number\n");
+        return -1;
+    }
+
+    if (!MOUNTED)
+    {
+        printf("fs_read Error: no filesystem mounted\n");
+        return -1;
+    }
+
+    int fd = fs_open(inumber);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    fs_seek(fd, offset);
+    int result = fileRead(fd, data, length);
+    fs_close(fd);
+
+    return result;
+}
+
+static int doWrite( int inumber, const char *data, int length, int offset )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        printf("fs_write Error: invalid inode number\n");
+        return 0;
+    }
+
+    if (!MOUNTED)
+    {
+        printf("fs_write Error: filesystem not mounted\n");
+        return 0;
+    }
+
+    int fd = fs_open(inumber);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    int result = 0;
+    if (files[fd]->node->type == FS_INODE_DIR)
+    {
+        printf("fs_write Error: inode %d is a directory\n", inumber);
+    }
+    else
+    {
+        fs_seek(fd, offset);
+        result = fileWrite(fd, data, length);
+    }
+    fs_close(fd);
+
+    return result;
+}
+
+static int doFwrite( int fd, const char *data, int length ) // directories are written only by the directory code
+{
+    if (fd >= 0 && fd < MAX_OPEN_FILES && files[fd] && files[fd]->node->type == FS_INODE_DIR)
+    {
+        printf("fs_fwrite Error: inode %d is a directory\n", files[fd]->inumber);
+        return -1;
+    }
+
+    return fileWrite(fd, data, length);
+}
+
+static int doTruncate( int inumber, int size )
+{
+    if (!MOUNTED)
+    {
+        printf("fs_truncate Error: no filesystem mounted\n");
+        return 0;
+    }
+
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        printf("fs_truncate Error: invalid inode number\n");
+        return 0;
+    }
+
+    int origBlock = 1 + inumber / INODES_PER_BLOCK;
+
+    union fs_block block;
+
+    disk_read(origBlock, block.data);
+
+    struct fs_inode *inode = &block.inode[inumber % INODES_PER_BLOCK];
+
+    if (inode->isvalid == FS_INODE_DIR)
+    {
+        printf("fs_truncate Error: inode %d is a directory\n", inumber);
+        return 0;
+    }
+
+    if (inode->isvalid == 0 || size < 0 || size > MAX_FILE_BLOCKS * DISK_BLOCK_SIZE)
+    {
+        printf("fs_truncate Error: invalid inode or size\n");
+        return 0;
+    }
+
+    if (size > inode->size) // grow: allocate and zero, as a write past the end would
+    {
+        int fd = fs_open(inumber);
+        if (fd < 0)
+        {
+            return 0;
+        }
+
+        struct fs_node *node = files[fd]->node;
+        int oldSize = node->size;
+        int end = fileGrow(node, size);
+
+        zeroRange(node, oldSize, end);
+        fs_close(fd);
+        return end == size;
+    }
+
+    int keep = (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; // blocks still in use
+    int k;
+
+    for (k = keep; k < POINTERS_PER_INODE; k++)
+    {
+        freeBlock(inode->direct[k]);
+        inode->direct[k] = 0;
+    }
+
+    if (inode->indirect != 0)
+    {
+        union fs_block indir;
+        disk_read(inode->indirect, indir.data);
+
+        for (k = keep > POINTERS_PER_INODE ? keep - POINTERS_PER_INODE : 0; k < POINTERS_PER_BLOCK; k++)
+        {
+            freeBlock(indir.pointers[k]);
+            indir.pointers[k] = 0;
+        }
+
+        if (keep <= POINTERS_PER_INODE)
+        {
+            freeBlock(inode->indirect);
+            inode->indirect = 0;
+        }
+        else
+        {
+            disk_write(inode->indirect, indir.data);
+        }
+    }
+
+    inode->size = size;
+    disk_write(origBlock, block.data);
+    nodeReload(inumber, inode);
+
+    return 1;
+}
+
+static int doDelete( int inumber, int dirOk ) // only the directory code may delete a directory
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        printf("fs_delete Error: invalid inode number\n");
+        return 0;
+    }
+
+    int origBlock = 1 + inumber / INODES_PER_BLOCK;
+
+    union fs_block block;
+
+    disk_read(origBlock, block.data);
+
+    int index = inumber % INODES_PER_BLOCK;
+
+    if (block.inode[index].isvalid == 0)
+    {
+        return 0;
+    }
+
+    if (block.inode[index].isvalid == FS_INODE_DIR && !dirOk)
+    {
+        printf("fs_delete Error: inode %d is a directory, unlink it by path\n", inumber);
+        return 0;
+    }
+
+    int i;
+
+    if (MOUNTED) // give the blocks back to the bitmap
+    {
+        for (i = 0; i < POINTERS_PER_INODE; i++)
+        {
+            freeBlock(block.inode[index].direct[i]);
+        }
+
+        if (block.inode[index].indirect != 0)
+        {
+            union fs_block indir;
+            disk_read(block.inode[index].indirect, indir.data);
+            for (i = 0; i < POINTERS_PER_BLOCK; i++)
+            {
+                freeBlock(indir.pointers[i]);
+            }
+            freeBlock(block.inode[index].indirect);
+        }
+    }
+
+    block.inode[index].isvalid = 0;
+    block.inode[index].size = 0;
+
+    if (MOUNTED)
+    {
+        super.nfreeinodes++;
+    }
+
+    for (i = 0; i < POINTERS_PER_INODE; i++)
+    {
+        block.inode[index].direct[i] = 0;
+    }
+
+    block.inode[index].indirect = 0;
+
+    disk_write(origBlock, block.data);
+
+    struct fs_node *node = findNode(inumber);
+    if (node) // descriptors still open on it see an empty, invalid inode; a file reusing the inumber gets a node of its own
+    {
+        nodeLoad(node, &block.inode[index]);
+        for (i = 0; i < MAX_OPEN_FILES; i++)
+        {
+            if (nodes[i] == node)
+            {
+                nodes[i] = 0;
+            }
+        }
+    }
+
+	return 1;
+}
+
+static unsigned dirHash( const char *name ) // FNV-1a
+{
+    unsigned hash = 2166136261u;
+
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int dirBlock( int fd, int fileBlock, union fs_block *block, int write ) // move one directory block
+{
+    fs_seek(fd, fileBlock * DISK_BLOCK_SIZE);
+
+    if (write)
+    {
+        return fileWrite(fd, block->data, DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+    }
+
+    return fileRead(fd, block->data, DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE && (fileBlock > 0 || block->dir.magic == FS_DIR_MAGIC);
+}
+
+static int dirOpen( int inumber ) // open a directory inode, reading its header
+{
+    int fd = fs_open(inumber);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (files[fd]->node->type != FS_INODE_DIR)
+    {
+        printf("fs Error: inode %d is not a directory\n", inumber);
+        fs_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+Find name in the directory open on fd.  Leaves the header and the bucket
+holding name in the caller's blocks and returns its slot, or returns -1
+leaving the first bucket of the chain with room (or the last one, if they
+are all full).
+*/
+static int dirFind( int fd, const char *name, union fs_block *header, union fs_block *bucket, int *fileBlock )
+{
+    if (!dirBlock(fd, 0, header, 0))
+    {
+        printf("fs Error: bad directory header\n");
+        *fileBlock = 0;
+        return -1;
+    }
+
+    unsigned hash = dirHash(name);
+
+    int next = header->dir.table[hash & ((1u << header->dir.depth) - 1)];
+    int room = 0;
+    int i;
+
+    while (next)
+    {
+        if (!dirBlock(fd, next, bucket, 0))
+        {
+            printf("fs Error: bad directory bucket\n");
+            *fileBlock = 0;
+            return -1;
+        }
+
+        *fileBlock = next;
+
+        for (i = 0; i < bucket->bucket.count; i++)
+        {
+            if (!strcmp(bucket->bucket.entry[i].name, name))
+            {
+                return i;
+            }
+        }
+
+        if (!room && bucket->bucket.count < DIRENTS_PER_BUCKET)
+        {
+            room = next;
+        }
+        next = bucket->bucket.next;
+    }
+
+    if (room && room != *fileBlock) // go back to the bucket with space
+    {
+        *fileBlock = room;
+        dirBlock(fd, room, bucket, 0);
+    }
+
+    return -1;
+}
+
+static int dirLookup( int dir, const char *name )
+{
+    int fd = dirOpen(dir);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    union fs_block header, bucket;
+    int fileBlock;
+    int slot = dirFind(fd, name, &header, &bucket, &fileBlock);
+
+    fs_close(fd);
+
+    return slot < 0 ? 0 : bucket.bucket.entry[slot].inumber;
+}
+
+static int dirAdd( int dir, const char *name, int inumber )
+{
+    int fd = dirOpen(dir);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    union fs_block header, bucket;
+    int fileBlock;
+
+    while (1)
+    {
+        int slot = dirFind(fd, name, &header, &bucket, &fileBlock);
+
+        if (fileBlock == 0)
+        {
+            break;
+        }
+
+        if (slot >= 0)
+        {
+            printf("fs Error: %s already exists\n", name);
+            break;
+        }
+
+        if (bucket.bucket.count < DIRENTS_PER_BUCKET) // room in the bucket
+        {
+            struct fs_dirent *entry = &bucket.bucket.entry[bucket.bucket.count++];
+            memset(entry, 0, sizeof(*entry));
+            entry->inumber = inumber;
+            strcpy(entry->name, name);
+            header.dir.nentries++;
+
+            int ok = dirBlock(fd, fileBlock, &bucket, 1) && dirBlock(fd, 0, &header, 1);
+            fs_close(fd);
+            return ok;
+        }
+
+        if (header.dir.nbuckets + 1 >= MAX_FILE_BLOCKS)
+        {
+            printf("fs Error: directory is full\n");
+            break;
+        }
+
+        int newBlock = header.dir.nbuckets + 1;
+        union fs_block split;
+
+        memset(split.data, 0, sizeof(split.data));
+
+        if (bucket.bucket.depth == FS_DIR_MAXDEPTH) // can't split any more, chain an overflow bucket
+        {
+            split.bucket.depth = FS_DIR_MAXDEPTH;
+            if (!dirBlock(fd, newBlock, &split, 1))
+            {
+                printf("fs Error: No more open blocks\n");
+                break;
+            }
+            header.dir.nbuckets = newBlock;
+            bucket.bucket.next = newBlock;
+
+            if (!dirBlock(fd, fileBlock, &bucket, 1) || !dirBlock(fd, 0, &header, 1))
+            {
+                break;
+            }
+            continue;
+        }
+
+        // bucket is full: split it, doubling the table first if it has to
+        if (bucket.bucket.depth == header.dir.depth)
+        {
+            int n = 1 << header.dir.depth;
+            memcpy(&header.dir.table[n], &header.dir.table[0], n * sizeof(short));
+            header.dir.depth++;
+        }
+
+        unsigned bit = 1u << bucket.bucket.depth;
+        int i, kept = 0;
+
+        bucket.bucket.depth++;
+        split.bucket.depth = bucket.bucket.depth;
+
+        for (i = 0; i < bucket.bucket.count; i++)
+        {
+            if (dirHash(bucket.bucket.entry[i].name) & bit)
+            {
+                split.bucket.entry[split.bucket.count++] = bucket.bucket.entry[i];
+            }
+            else
+            {
+                bucket.bucket.entry[kept++] = bucket.bucket.entry[i];
+            }
+        }
+        bucket.bucket.count = kept;
+
+        for (i = 0; i < (1 << header.dir.depth); i++)
+        {
+            if (header.dir.table[i] == fileBlock && (i & bit))
+            {
+                header.dir.table[i] = newBlock;
+            }
+        }
+
+        if (!dirBlock(fd, newBlock, &split, 1)) // the new bucket goes first, the header commits the split
+        {
+            printf("fs Error: No more open blocks\n");
+            break;
+        }
+        header.dir.nbuckets = newBlock;
+
+        if (!dirBlock(fd, fileBlock, &bucket, 1) || !dirBlock(fd, 0, &header, 1))
+        {
+            break;
+        }
+    }
+
+    fs_close(fd);
+    return 0;
+}
+
+static int dirRemove( int dir, const char *name ) // returns the inumber the name pointed to
+{
+    int fd = dirOpen(dir);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    union fs_block header, bucket;
+    int fileBlock;
+    int slot = dirFind(fd, name, &header, &bucket, &fileBlock);
+    int inumber = 0;
+
+    if (slot >= 0)
+    {
+        inumber = bucket.bucket.entry[slot].inumber;
+        bucket.bucket.entry[slot] = bucket.bucket.entry[--bucket.bucket.count];
+        memset(&bucket.bucket.entry[bucket.bucket.count], 0, sizeof(struct fs_dirent));
+        header.dir.nentries--;
+
+        if (!dirBlock(fd, fileBlock, &bucket, 1) || !dirBlock(fd, 0, &header, 1))
+        {
+            inumber = 0;
+        }
+    }
+
+    fs_close(fd);
+    return inumber;
+}
+
+static int inodeClaim( int inumber ) // make one particular free inode a new, empty file
+{
+    union fs_block block;
+    struct fs_inode *inode = &block.inode[inumber % INODES_PER_BLOCK];
+
+    disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
+    if (inode->isvalid != 0)
+    {
+        return 0;
+    }
+
+    memset(inode, 0, sizeof(*inode));
+    inode->isvalid = FS_INODE_FILE;
+    super.nfreeinodes--;
+    disk_write(1 + inumber / INODES_PER_BLOCK, block.data);
+    return inumber;
+}
+
+static int dirCreate( int want ) // new, empty, unnamed directory inode, at want if that is free
+{
+    int inumber = want ? inodeClaim(want) : 0;
+    if (inumber == 0)
+    {
+        inumber = doCreate();
+    }
+    if (inumber < 1)
+    {
+        return 0;
+    }
+
+    int origBlock = 1 + inumber / INODES_PER_BLOCK;
+    union fs_block block;
+
+    disk_read(origBlock, block.data);
+    block.inode[inumber % INODES_PER_BLOCK].isvalid = FS_INODE_DIR;
+    disk_write(origBlock, block.data);
+
+    int fd = fs_open(inumber);
+    int ok;
+
+    dirInit(&block);
+    ok = dirBlock(fd, 0, &block, 1);
+    memset(block.data, 0, sizeof(block.data));
+    ok = ok && dirBlock(fd, 1, &block, 1);
+    fs_close(fd);
+
+    if (!ok)
+    {
+        doDelete(inumber, 1);
+        return 0;
+    }
+
+    return inumber;
+}
+
+static int dirRoot() // root directory, made on first use on images formatted before directories existed
+{
+    if (!MOUNTED)
+    {
+        printf("fs Error: no filesystem mounted\n");
+        return 0;
+    }
+
+    if (super.root)
+    {
+        return super.root;
+    }
+
+    int inumber = dirCreate(super.ninodes - 1); // out of fs_create's way, as fs_format puts it
+    if (inumber == 0)
+    {
+        return 0;
+    }
+
+    union fs_block block;
+
+    disk_read(0, block.data);
+    block.super.root = inumber;
+    disk_write(0, block.data);
+
+    super.root = inumber;
+    return inumber;
+}
+
+/*
+Walk every component of path but the last, which is copied into name.
+Returns the directory that should hold name, or 0.  Paths are always taken
+from the root; a leading slash is optional.
+*/
+static int pathParent( const char *path, char *name )
+{
+    int dir = dirRoot();
+
+    while (dir)
+    {
+        while (*path == '/')
+        {
+            path++;
+        }
+
+        int len = strcspn(path, "/");
+        if (len == 0 || len > FS_NAME_MAX)
+        {
+            printf("fs Error: bad path component\n");
+            return 0;
+        }
+
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len;
+
+        while (*path == '/')
+        {
+            path++;
+        }
+
+        if (*path == 0)
+        {
+            return dir;
+        }
+
+        dir = dirLookup(dir, name);
+        if (dir == 0)
+        {
+            printf("fs Error: %s not found\n", name);
+        }
+    }
+
+    return 0;
+}
+
+int fs_readdir( int inumber, void (*fn)( const char *name, int inumber, void *arg ), void *arg )
+{
+    int fd = dirOpen(inumber);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    union fs_block header, bucket;
+    int i, j, count = 0;
+
+    if (!dirBlock(fd, 0, &header, 0))
+    {
+        fs_close(fd);
+        return -1;
+    }
+
+    for (i = 1; i <= header.dir.nbuckets; i++)
+    {
+        if (!dirBlock(fd, i, &bucket, 0))
+        {
+            break;
+        }
+        for (j = 0; j < bucket.bucket.count; j++)
+        {
+            fn(bucket.bucket.entry[j].name, bucket.bucket.entry[j].inumber, arg);
+            count++;
+        }
+    }
+
+    fs_close(fd);
+    return count;
+}
+
+static void markNamed( const char *name, int inumber, void *arg )
+{
+    if (inumber > 0 && inumber < super.ninodes)
+    {
+        named[inumber] = 1;
+    }
+}
+
+/*
+Whether a directory entry names the file.  A file has at most one name, so
+that unlinking it can free it.  The first call walks every directory; from
+then on link and unlink keep the map.
+*/
+static int hasName( int inumber )
+{
+    if (!MOUNTED || inumber < 1 || inumber >= super.ninodes)
+    {
+        return 0;
+    }
+
+    if (!named)
+    {
+        union fs_block block;
+        int i, j;
+
+        named = calloc(super.ninodes, 1);
+        for (i = 1; i <= super.ninodeblocks; i++)
+        {
+            disk_read(i, block.data);
+            for (j = 1; j < INODES_PER_BLOCK; j++)
+            {
+                if (block.inode[j].isvalid == FS_INODE_DIR)
+                {
+                    fs_readdir((i-1)*INODES_PER_BLOCK + j, markNamed, 0);
+                }
+            }
+        }
+    }
+
+    return named ? named[inumber] : 0;
+}
+
+static int fileDelete( int inumber ) // fs_delete leaves named files to fs_unlink
+{
+    if (hasName(inumber))
+    {
+        printf("fs_delete Error: inode %d has a name; unlink it instead\n", inumber);
+        return 0;
+    }
+
+    return doDelete(inumber, 0);
+}
+
+int fs_isdir( int inumber )
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        return 0;
+    }
+
+    union fs_block block;
+
+    disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
+
+    return block.inode[inumber % INODES_PER_BLOCK].isvalid == FS_INODE_DIR;
+}
+
+int fs_stat( int inumber, int *size ) // returns the inode type (0 if not in use) and its size
+{
+    if (inumber < 1 || inumber >= fs_ninodes())
+    {
+        return 0;
+    }
+
+    union fs_block block;
+
+    disk_read(1 + inumber / INODES_PER_BLOCK, block.data);
+
+    struct fs_inode *inode = &block.inode[inumber % INODES_PER_BLOCK];
+
+    *size = inode->size;
+    return inode->isvalid;
+}
+
+int fs_root()
+{
+    return dirRoot();
+}
+
+static int nameOk( const char *name )
+{
+    if (name[0] == 0 || strlen(name) > FS_NAME_MAX || strchr(name, '/'))
+    {
+        printf("fs Error: bad name %s\n", name);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int doLookupat( int dir, const char *name )
+{
+    return nameOk(name) ? dirLookup(dir, name) : 0;
+}
+
+static int doLinkat( int dir, const char *name, int inumber )
+{
+    if (!fs_isvalid(inumber))
+    {
+        printf("fs_link Error: invalid inode number\n");
+        return 0;
+    }
+
+    if (fs_isdir(inumber)) // a second parent could make a cycle
+    {
+        printf("fs_link Error: inode %d is a directory\n", inumber);
+        return 0;
+    }
+
+    if (hasName(inumber)) // unlinking either name would free it under the other
+    {
+        printf("fs_link Error: inode %d already has a name\n", inumber);
+        return 0;
+    }
+
+    if (!nameOk(name) || !dirAdd(dir, name, inumber))
+    {
+        return 0;
+    }
+
+    if (named)
+    {
+        named[inumber] = 1;
+    }
+    return 1;
+}
+
+static int doMkdirat( int dir, const char *name )
+{
+    if (!nameOk(name))
+    {
+        return 0;
+    }
+
+    if (dirLookup(dir, name))
+    {
+        printf("fs_mkdir Error: %s already exists\n", name);
+        return 0;
+    }
+
+    int inumber = dirCreate(0);
+    if (inumber == 0)
+    {
+        return 0;
+    }
+
+    if (!dirAdd(dir, name, inumber))
+    {
+        doDelete(inumber, 1);
+        return 0;
+    }
+
+    return inumber;
+}
+
+static int doUnlinkat( int dir, const char *name )
+{
+    if (!nameOk(name))
+    {
+        return 0;
+    }
+
+    int inumber = dirLookup(dir, name);
+    if (inumber == 0)
+    {
+        printf("fs_unlink Error: %s not found\n", name);
+        return 0;
+    }
+
+    if (fs_isdir(inumber))
+    {
+        int fd = dirOpen(inumber);
+        union fs_block header;
+        int empty = fd >= 0 && dirBlock(fd, 0, &header, 0) && header.dir.nentries == 0;
+
+        if (fd >= 0)
+        {
+            fs_close(fd);
+        }
+        if (!empty)
+        {
+            printf("fs_unlink Error: directory %s is not empty\n", name);
+            return 0;
+        }
+    }
+
+    if (!dirRemove(dir, name))
+    {
+        return 0;
+    }
+
+    if (named)
+    {
+        named[inumber] = 0;
+    }
+    if (fs_isvalid(inumber)) // a name left dangling by an older image has nothing to free
+    {
+        doDelete(inumber, 1);
+    }
+
+    return 1;
+}
+
+int fs_lookup( const char *path )
+{
+    char name[FS_NAME_MAX + 1];
+
+    if (strspn(path, "/") == strlen(path)) // "/" itself
+    {
+        return dirRoot();
+    }
+
+    int dir = pathParent(path, name);
+
+    return dir ? fs_lookupat(dir, name) : 0;
+}
+
+int fs_link( const char *path, int inumber )
+{
+    char name[FS_NAME_MAX + 1];
+
+    int dir = pathParent(path, name);
+
+    return dir ? fs_linkat(dir, name, inumber) : 0;
+}
+
+int fs_mkdir( const char *path )
+{
+    char name[FS_NAME_MAX + 1];
+
+    int dir = pathParent(path, name);
+
+    return dir ? fs_mkdirat(dir, name) : 0;
+}
+
+int fs_unlink( const char *path )
+{
+    char name[FS_NAME_MAX + 1];
+
+    int dir = pathParent(path, name);
+
+    return dir ? fs_unlinkat(dir, name) : 0;
+}
+
+/*
+Defragmentation.  A file is laid out ideally as its indirect block, if it
+has one, followed by all of its data blocks in order: one extent.  relocate
+copies a file into a free run of that shape.  The data goes first, then the
+new indirect block, and writing the inode is the commit point, so a crash at
+any moment leaves either the old copy or the new one.  The old blocks are
+freed only after that.
+*/
+static int findRun( int need, int below ) // first run of need free blocks starting before below, or -1
+{
+    int i, len = 0;
+
+    for (i = super.ninodeblocks + 1; i < disk_size() && i - len < below; i++)
+    {
+        len = bitmap[i] ? 0 : len + 1;
+        if (len == need)
+        {
+            return i - need + 1;
+        }
+    }
+
+    return -1;
+}
+
+static int layoutExtents( const struct fs_inode *inode, const int *blocks, int n )
+{
+    int i, extents = 0;
+
+    for (i = 0; i < n; i += extent_length(blocks, i, n))
+    {
+        extents++;
+    }
+
+    if (n > POINTERS_PER_INODE && inode->indirect + 1 != blocks[0]) // indirect block out of line
+    {
+        extents++;
+    }
+
+    return extents;
+}
+
+static int layoutStart( const struct fs_inode *inode, const int *blocks, int n ) // lowest block the file holds
+{
+    int i, low = n > POINTERS_PER_INODE ? inode->indirect : blocks[0];
+
+    for (i = 0; i < n; i++)
+    {
+        if (blocks[i] < low)
+        {
+            low = blocks[i];
+        }
+    }
+
+    return low;
+}
+
+static void refreshOpenFiles( int inumber, const int *blocks, int n ) // open descriptors hold block numbers too
+{
+    struct fs_node *node = findNode(inumber);
+    int i;
+
+    for (i = 0; node && i < node->nblocks && i < n; i++)
+    {
+        node->blocks[i] = blocks[i];
+    }
+}
+
+static void relocate( int inumber, union fs_block *block, const int *blocks, int n, int to )
+{
+    struct fs_inode *inode = &block->inode[inumber % INODES_PER_BLOCK];
+    int hasIndirect = n > POINTERS_PER_INODE;
+    int oldIndirect = inode->indirect;
+    int first = to + hasIndirect; // first data block
+    char *data = malloc(n * DISK_BLOCK_SIZE);
+    int now[MAX_FILE_BLOCKS];
+    int i, run;
+
+    for (i = 0; i < n; i += run)
+    {
+        run = extent_length(blocks, i, n);
+        disk_read_extent(blocks[i], run, data + i * DISK_BLOCK_SIZE);
+    }
+
+    for (i = to; i < first + n; i++)
+    {
+        markBlock(i, 1);
+    }
+
+    disk_write_extent(first, n, data);
+    disk_set_type(first, n, DISK_BLOCK_DATA);
+
+    for (i = 0; i < n && i < POINTERS_PER_INODE; i++)
+    {
+        inode->direct[i] = first + i;
+    }
+
+    if (hasIndirect)
+    {
+        union fs_block indir;
+
+        memset(indir.data, 0, sizeof(indir.data));
+        for (i = POINTERS_PER_INODE; i < n; i++)
+        {
+            indir.pointers[i - POINTERS_PER_INODE] = first + i;
+        }
+        disk_write(to, indir.data);
+        disk_set_type(to, 1, DISK_BLOCK_INDIRECT);
+        inode->indirect = to;
+    }
+
+    disk_flush(); // the new copy must be on disk before the inode points at it
+    disk_write(1 + inumber / INODES_PER_BLOCK, block->data); // commit
+    disk_flush(); // and the inode before anything reuses the old blocks
+
+    for (i = 0; i < n; i++)
+    {
+        freeBlock(blocks[i]);
+        now[i] = first + i;
+    }
+    if (hasIndirect)
+    {
+        freeBlock(oldIndirect);
+    }
+
+    refreshOpenFiles(inumber, now, n);
+    free(data);
+}
+
+struct defrag_file {
+    int inumber;
+    int start;
+};
+
+static int defragCompare( const void *a, const void *b ) // furthest from the front first
+{
+    return ((const struct defrag_file *)b)->start - ((const struct defrag_file *)a)->start;
+}
+
+/*
+Move every file that sits in more than one extent into a single free run,
+then, to compact, keep moving files from the back of the disk into the
+earliest run that fits them until nothing moves.  Returns the number of
+files moved.
+*/
+int fs_defrag( int mode )
+{
+    if (!MOUNTED)
+    {
+        printf("fs_defrag Error: no filesystem mounted\n");
+        return -1;
+    }
+
+    int blocks[MAX_FILE_BLOCKS];
+    struct defrag_file *list = malloc(sizeof(*list) * super.ninodes);
+    int nfiles = 0, fragmented = 0, extents = 0, moved = 0, movedBlocks = 0;
+    int i, j, n, e, to, again;
+
+    for (i = 1; i <= super.ninodeblocks; i++)
+    {
+        union fs_block block;
+        disk_read(i, block.data);
+
+        for (j = 0; j < INODES_PER_BLOCK; j++)
+        {
+            struct fs_inode *inode = &block.inode[j];
+            int inumber = (i - 1) * INODES_PER_BLOCK + j;
+
+            if (inumber == 0 || inode->isvalid == 0 || inode->size <= 0)
+            {
+                continue;
+            }
+
+            n = inode_map(inode, blocks, (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, 0);
+            if (n == 0)
+            {
+                continue;
+            }
+
+            e = layoutExtents(inode, blocks, n);
+            list[nfiles].inumber = inumber;
+            list[nfiles].start = layoutStart(inode, blocks, n);
+            nfiles++;
+            extents += e;
+
+            if (e == 1)
+            {
+                continue;
+            }
+
+            fragmented++;
+            if (mode == FS_DEFRAG_REPORT)
+            {
+                printf("    inode %d: %d blocks in %d extents\n", inumber, n, e);
+                continue;
+            }
+
+            to = findRun(n + (n > POINTERS_PER_INODE), disk_size());
+            if (to < 0)
+            {
+                printf("    inode %d: no free run of %d blocks\n", inumber, n + (n > POINTERS_PER_INODE));
+                continue;
+            }
+
+            relocate(inumber, &block, blocks, n, to);
+            list[nfiles - 1].start = to;
+            moved++;
+            movedBlocks += n;
+        }
+    }
+
+    printf("%d files in %d extents, %d fragmented (ideal is one extent each)\n", nfiles, extents, fragmented);
+
+    for (again = mode == FS_DEFRAG_COMPACT; again; )
+    {
+        again = 0;
+        qsort(list, nfiles, sizeof(*list), defragCompare);
+
+        for (i = 0; i < nfiles; i++)
+        {
+            union fs_block block;
+            disk_read(1 + list[i].inumber / INODES_PER_BLOCK, block.data);
+            struct fs_inode *inode = &block.inode[list[i].inumber % INODES_PER_BLOCK];
+
+            n = inode_map(inode, blocks, (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, 0);
+            to = findRun(n + (n > POINTERS_PER_INODE), list[i].start);
+            if (to < 0)
+            {
+                continue;
+            }
+
+            relocate(list[i].inumber, &block, blocks, n, to);
+            list[i].start = to;
+            moved++;
+            movedBlocks += n;
+            again = 1;
+        }
+    }
+
+    if (mode != FS_DEFRAG_REPORT)
+    {
+        printf("moved %d files (%d blocks)\n", moved, movedBlocks);
+    }
+
+    for (i = disk_size() - 1; i > super.ninodeblocks && !bitmap[i]; i--);
+    printf("last block in use is %d: the image could shrink to %d of %d blocks\n", i, i + 1, disk_size());
+
+    free(list);
+    return moved;
+}
+
+/*
+Tiering.  On a tiered disk the blocks below disk_tier_blocks() are fast and
+the rest slow, and the disk counts accesses to every block.  A migration
+pass moves data blocks that went untouched since the last pass down to the
+slow tier, and those touched FS_HOT_HEAT times or more up into the room
+that leaves, then halves the counts.  As in relocate, the copies reach the
+disk before the inode and indirect block point at them, and the old blocks
+are freed only after.  Inode and indirect blocks stay where they are.
+*/
+#define FS_HOT_HEAT 2
+
+static int migrateInode( int inumber, union fs_block *block, int *blocks, int n, int budget )
+{
+    struct fs_inode *inode = &block->inode[inumber % INODES_PER_BLOCK];
+    int tier = disk_tier_blocks();
+    int old[MAX_FILE_BLOCKS];
+    int i, b, to, moved = 0;
+    union fs_block data;
+
+    for (i = 0; i < n && moved < budget; i++)
+    {
+        b = blocks[i];
+        if (b < tier && disk_heat(b) == 0)
+        {
+            to = nextOpenIn(tier, disk_size()); // cold: demote
+        }
+        else if (b >= tier && disk_heat(b) >= FS_HOT_HEAT)
+        {
+            to = nextOpenIn(super.ninodeblocks + 1, tier); // hot: promote
+        }
+        else
+        {
+            continue;
+        }
+
+        if (to < 0)
+        {
+            continue;
+        }
+
+        disk_read(b, data.data);
+        disk_write(to, data.data);
+        disk_set_type(to, 1, DISK_BLOCK_DATA);
+        disk_heat_move(b, to);
+        old[moved++] = b;
+        blocks[i] = to;
+    }
+
+    if (moved == 0)
+    {
+        return 0;
+    }
+
+    disk_flush(); // the copies must be on disk before anything points at them
+
+    for (i = 0; i < n && i < POINTERS_PER_INODE; i++)
+    {
+        inode->direct[i] = blocks[i];
+    }
+
+    if (n > POINTERS_PER_INODE)
+    {
+        union fs_block indir;
+
+        disk_read(inode->indirect, indir.data);
+        for (i = POINTERS_PER_INODE; i < n; i++)
+        {
+            indir.pointers[i - POINTERS_PER_INODE] = blocks[i];
+        }
+        disk_write(inode->indirect, indir.data);
+    }
+
+    disk_write(1 + inumber / INODES_PER_BLOCK, block->data);
+    disk_flush(); // and the pointers before anything reuses the old blocks
+
+    for (i = 0; i < moved; i++)
+    {
+        freeBlock(old[i]);
+    }
+
+    refreshOpenFiles(inumber, blocks, n);
+    return moved;
+}
+
+/*
+Run one migration pass moving at most budget blocks.  Returns the number of
+blocks moved, or -1 if nothing is mounted or the disk is not tiered.
+*/
+int fs_migrate( int budget )
+{
+    if (!MOUNTED)
+    {
+        printf("fs_migrate Error: no filesystem mounted\n");
+        return -1;
+    }
+
+    if (!disk_tier_blocks())
+    {
+        printf("fs_migrate Error: the disk is not tiered\n");
+        return -1;
+    }
+
+    int blocks[MAX_FILE_BLOCKS];
+    int i, j, n, moved = 0;
+
+    for (i = 1; i <= super.ninodeblocks && moved < budget; i++)
+    {
+        union fs_block block;
+        disk_read(i, block.data);
+
+        for (j = 0; j < INODES_PER_BLOCK && moved < budget; j++)
+        {
+            struct fs_inode *inode = &block.inode[j];
+            int inumber = (i - 1) * INODES_PER_BLOCK + j;
+
+            if (inumber == 0 || inode->isvalid == 0 || inode->size <= 0)
+            {
+                continue;
+            }
+
+            n = inode_map(inode, blocks, (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, 0);
+            moved += migrateInode(inumber, &block, blocks, n, budget - moved);
+        }
+    }
+
+    disk_heat_decay();
+    return moved;
+}
+
+/*
+Every entry point below is a thin wrapper that times the real work and
+charges it, along with the disk blocks it touched, to its opstats slot.
+The call and its arguments also go to the disk trace, if one is running,
+so that fsreplay can issue it again.  The directory calls are traced by
+parent and name; the path calls resolve to them.
+*/
+static void opDone( int op, long long start, int io, int result, int inumber, int offset, int length, const char *name )
+{
+    struct fs_opstats *stats = &opstats[op];
+
+    stats->calls++;
+    stats->blocks += disk_nrequested() - io;
+    stats_record(&stats->latency, stats_now() - start);
+
+    if (op >= FS_OP_READ && result > 0) // the data calls return a byte count
+    {
+        stats->bytes += result;
+    }
+
+    disk_trace_call(DISK_TRACE_FS + op, start, inumber, offset, length, result, name);
+}
+
+#define DISK_IO() disk_nrequested() // blocks asked for, not host I/O: the write queue defers and absorbs those
+
+int fs_mount()
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doMount();
+    opDone(FS_OP_MOUNT, start, io, result, 0, 0, 0, 0);
+    return result;
+}
+
+int fs_create()
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doCreate();
+    opDone(FS_OP_CREATE, start, io, result, 0, 0, 0, 0);
+    return result;
+}
+
+int fs_delete( int inumber )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = fileDelete(inumber);
+    opDone(FS_OP_DELETE, start, io, result, inumber, 0, 0, 0);
+    return result;
+}
+
+int fs_mkdirat( int dir, const char *name )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doMkdirat(dir, name);
+    opDone(FS_OP_MKDIR, start, io, result, dir, 0, 0, name);
+    return result;
+}
+
+int fs_linkat( int dir, const char *name, int inumber )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doLinkat(dir, name, inumber);
+    opDone(FS_OP_LINK, start, io, result, dir, inumber, 0, name);
+    return result;
+}
+
+int fs_unlinkat( int dir, const char *name )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doUnlinkat(dir, name);
+    opDone(FS_OP_UNLINK, start, io, result, dir, 0, 0, name);
+    return result;
+}
+
+int fs_lookupat( int dir, const char *name )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doLookupat(dir, name);
+    opDone(FS_OP_LOOKUP, start, io, result, dir, 0, 0, name);
+    return result;
+}
+
+int fs_truncate( int inumber, int size )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doTruncate(inumber, size);
+    opDone(FS_OP_TRUNCATE, start, io, result, inumber, 0, size, 0);
+    return result;
+}
+
+int fs_sync()
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doSync();
+    opDone(FS_OP_SYNC, start, io, result, 0, 0, 0, 0);
+    return result;
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doRead(inumber, data, length, offset);
+    opDone(FS_OP_READ, start, io, result, inumber, offset, length, 0);
+    return result;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doWrite(inumber, data, length, offset);
+    opDone(FS_OP_WRITE, start, io, result, inumber, offset, length, 0);
+    return result;
+}
+
+int fs_fread( int fd, char *data, int length )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int valid = fd >= 0 && fd < MAX_OPEN_FILES && files[fd];
+    int inumber = valid ? files[fd]->inumber : 0;
+    int offset = valid ? files[fd]->offset : 0;
+    int result = fileRead(fd, data, length);
+    opDone(FS_OP_FREAD, start, io, result, inumber, offset, length, 0);
+    return result;
+}
+
+int fs_fwrite( int fd, const char *data, int length )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int valid = fd >= 0 && fd < MAX_OPEN_FILES && files[fd];
+    int inumber = valid ? files[fd]->inumber : 0;
+    int offset = valid ? files[fd]->offset : 0;
+    int result = doFwrite(fd, data, length);
+    opDone(FS_OP_FWRITE, start, io, result, inumber, offset, length, 0);
+    return result;
+}
+
+int fs_copyin( int inumber, int fd, int length )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doCopyin(inumber, fd, length);
+    opDone(FS_OP_COPYIN, start, io, result, inumber, 0, length, 0);
+    return result;
+}
+
+int fs_copyout( int inumber, int fd )
+{
+    long long start = stats_now();
+    int io = DISK_IO();
+    int result = doCopyout(inumber, fd);
+    opDone(FS_OP_COPYOUT, start, io, result, inumber, 0, 0, 0);
+    return result;
+}
+
+void fs_stats()
+{
+    int i;
+
+    printf("fs operations:\n");
+    for (i = 0; i < FS_NUM_OPS; i++)
+    {
+        struct fs_opstats *stats = &opstats[i];
+        if (stats->calls == 0)
+        {
+            continue;
+        }
+        printf("    %-10s %lld calls %lld bytes %lld blocks\n", stats->name, stats->calls, stats->bytes, stats->blocks);
+        stats_print("", &stats->latency);
+    }
+}
@@ -1,15 +1,68 @@
 #ifndef FS_H
 #define FS_H
 
+/* The instrumented calls, as counted by fs_stats and recorded in a disk trace.
+   The data calls, which return a byte count, come from FS_OP_READ on. */
+enum { FS_OP_MOUNT, FS_OP_CREATE, FS_OP_DELETE, FS_OP_MKDIR, FS_OP_LINK, FS_OP_UNLINK, FS_OP_LOOKUP, FS_OP_TRUNCATE, FS_OP_SYNC, FS_OP_READ, FS_OP_WRITE, FS_OP_FREAD, FS_OP_FWRITE, FS_OP_COPYIN, FS_OP_COPYOUT, FS_NUM_OPS };
+
 void fs_debug();
+void fs_stats();
 int  fs_format();
 int  fs_mount();
+int  fs_sync();
+
+struct fs_statfs {
+	int nblocks;
+	int nfree;
+	int ninodes;            // inodes fs_create can hand out
+	int nfreeinodes;
+	int freeExtents;        // runs of free blocks
+	int largestFree;        // blocks in the longest of them
+};
+
+int  fs_statfs( struct fs_statfs *st );
 
 int  fs_create();
 int  fs_delete( int inumber );
 int  fs_getsize();
+int  fs_ninodes();
+int  fs_isvalid( int inumber );
+int  fs_stat( int inumber, int *size );
+int  fs_truncate( int inumber, int size );
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
 
+int  fs_open( int inumber );
+int  fs_close( int fd );
+int  fs_seek( int fd, int offset );
+int  fs_fread( int fd, char *data, int length );
+int  fs_fwrite( int fd, const char *data, int length );
+int  fs_fextent( int fd, int fileBlock, int *blocknum );
+
+int  fs_isdir( int inumber );
+int  fs_root();
+int  fs_lookupat( int dir, const char *name );
+int  fs_mkdirat( int dir, const char *name );
+int  fs_linkat( int dir, const char *name, int inumber );
+int  fs_unlinkat( int dir, const char *name );
+int  fs_lookup( const char *path );
+int  fs_mkdir( const char *path );
+int  fs_link( const char *path, int inumber );
+int  fs_unlink( const char *path );
+int  fs_readdir( int inumber, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
+
+int  fs_copyin( int inumber, int fd, int length );
+int  fs_copyout( int inumber, int fd );
+
+#define FS_DEFRAG_REPORT  0 // only measure
+#define FS_DEFRAG_FILES   1 // make each file contiguous
+#define FS_DEFRAG_COMPACT 2 // and pack them toward the front of the disk
+
+int  fs_defrag( int mode );
+
+#define FS_MIGRATE_BUDGET 256 // blocks a migration pass moves by default
+
+int  fs_migrate( int budget );
+
 #endif
@@ -0,0 +1,80 @@
+#ifndef FS_LAYOUT_H
+#define FS_LAYOUT_H
+
+#include "disk.h"
+
+/*
+The on-disk format, shared by the filesystem and the tools that read an
+image directly.  Block 0 is the superblock, blocks 1..ninodeblocks hold
+the inodes, and everything after that is data and indirect blocks.
+*/
+
+#define FS_MAGIC           0xf0f03410
+#define INODES_PER_BLOCK   128
+#define POINTERS_PER_INODE 5
+#define POINTERS_PER_BLOCK 1024
+#define MAX_FILE_BLOCKS    (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+
+#define FS_INODE_FILE      1 // values of isvalid
+#define FS_INODE_DIR       2
+
+#define FS_DIR_MAGIC       0xd1d1d1d1
+#define FS_DIR_MAXDEPTH    10
+#define FS_NAME_MAX        27
+#define DIRENTS_PER_BUCKET 127
+
+struct fs_superblock {
+	int magic;
+	int nblocks;
+	int ninodeblocks;
+	int ninodes;
+	int root;               // inumber of the root directory, 0 if none
+	int nfree;              // free blocks and inodes as of the last sync,
+	int nfreeinodes;        // recounted at every mount
+};
+
+struct fs_inode {
+	int isvalid;
+	int size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
+};
+
+/*
+A directory is an extendible hash.  Block 0 of the directory file is the
+header, whose table maps the low depth bits of a name's hash to the file
+block of its bucket; every other block is a bucket.  A full bucket is split
+in two, doubling the table when its depth has caught up with the header's,
+so finding a name costs the header plus one bucket.  Once the table is at
+its largest, full buckets are chained to overflow buckets instead.
+*/
+struct fs_dirheader {
+	int magic;
+	int depth;
+	int nbuckets;           // buckets are file blocks 1..nbuckets
+	int nentries;
+	short table[1 << FS_DIR_MAXDEPTH];
+};
+
+struct fs_dirent {
+	int inumber;
+	char name[FS_NAME_MAX + 1];
+};
+
+struct fs_dirbucket {
+	int depth;
+	int count;
+	int next;               // overflow bucket, only at FS_DIR_MAXDEPTH
+	struct fs_dirent entry[DIRENTS_PER_BUCKET];
+};
+
+union fs_block {
+	struct fs_superblock super;
+	struct fs_inode inode[INODES_PER_BLOCK];
+	int pointers[POINTERS_PER_BLOCK];
+	struct fs_dirheader dir;
+	struct fs_dirbucket bucket;
+	char data[DISK_BLOCK_SIZE];
+};
+
+#endif
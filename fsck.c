@@ -0,0 +1,479 @@
+#include "disk.h"
+#include "fs_layout.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+fsck.simplefs checks an image without mounting it.  The inode table is
+split into chunks that a pool of threads scan in parallel: each inode is
+checked against its own size and pointers, then every block it holds is
+claimed in a shared owner map.  A claim is a compare-and-swap that keeps
+the lowest inumber, so a block held by two inodes is caught by whichever
+claim comes second, and the same inode keeps it however the threads race.
+
+The image is opened read-only and at the size its superblock gives; it is
+never created or resized.
+
+With -y the damage is repaired afterwards, serially: inodes that cannot be
+trusted are cleared, files that lost a block are truncated just before it,
+pointers past the end of a file are zeroed and directory entries naming
+free inodes are removed.  Blocks nobody points to any more are free at the
+next mount, since the free block bitmap is rebuilt from the inodes.
+*/
+
+#define CHUNK_BLOCKS 32     // inode blocks handed to a thread at a time
+
+struct problem {
+	int inumber;            // -1 for the superblock
+	int seq;                // order found, to keep each inode's problems in order
+	char text[128];
+};
+
+static struct fs_superblock super;
+static int *owner;                  // lowest inumber claiming each block, 0 if none
+static unsigned char *shared;       // blocks claimed more than once
+static unsigned char *inuse;        // isvalid of every inode the scan kept
+static int next_chunk = 1;          // next inode block to hand out
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct problem *problems;
+static int nproblems = 0, problems_size = 0;
+static int *fixes;                  // inodes that need another look when repairing
+static int nfixes = 0, fixes_size = 0;
+
+static long long nfiles = 0, ndirs = 0, ndata = 0, nindirect = 0;
+
+static void report( int inumber, const char *fmt, ... )
+{
+	va_list args;
+
+	pthread_mutex_lock(&lock);
+	if(nproblems==problems_size) {
+		problems_size = problems_size ? problems_size*2 : 64;
+		problems = realloc(problems,sizeof(*problems)*problems_size);
+	}
+	problems[nproblems].inumber = inumber;
+	problems[nproblems].seq = nproblems;
+	va_start(args,fmt);
+	vsnprintf(problems[nproblems].text,sizeof(problems[nproblems].text),fmt,args);
+	va_end(args);
+	nproblems++;
+	pthread_mutex_unlock(&lock);
+}
+
+static void needs_fix( int inumber )
+{
+	pthread_mutex_lock(&lock);
+	if(nfixes==fixes_size) {
+		fixes_size = fixes_size ? fixes_size*2 : 64;
+		fixes = realloc(fixes,sizeof(*fixes)*fixes_size);
+	}
+	fixes[nfixes++] = inumber;
+	pthread_mutex_unlock(&lock);
+}
+
+static int compare_problems( const void *a, const void *b )
+{
+	const struct problem *x = a, *y = b;
+
+	if(x->inumber!=y->inumber) return x->inumber<y->inumber ? -1 : 1;
+	return x->seq-y->seq;
+}
+
+static int compare_ints( const void *a, const void *b )
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+static int in_data( int blocknum )
+{
+	return blocknum>super.ninodeblocks && blocknum<super.nblocks;
+}
+
+/*
+Check one inode against its own pointers: every block up to its size must
+be in the data area, with an indirect block once the direct pointers run
+out, and nothing may be pointed to past the size.  Fills blocks[] with the
+pointers in file order and returns how many of them are good, or -1 if the
+inode has to be cleared.  *stray is set when pointers past the size need
+zeroing.  Problems are reported only when loud is set, so that the repair
+pass can run it again quietly.
+*/
+static int check_inode( int inumber, const struct fs_inode *inode, int *blocks, int *stray, int loud )
+{
+	union fs_block indirect;
+	int nblocks, nptrs, good, i;
+
+	*stray = 0;
+
+	if(inumber==0) {
+		if(loud) report(inumber,"is in use, but inumber 0 means no inode");
+		return -1;
+	}
+
+	if(inode->isvalid!=FS_INODE_FILE && inode->isvalid!=FS_INODE_DIR) {
+		if(loud) report(inumber,"has unknown type %d",inode->isvalid);
+		return -1;
+	}
+
+	if(inode->size<0 || inode->size>MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) {
+		if(loud) report(inumber,"has size %d, out of range",inode->size);
+		nblocks = inode->size<0 ? 0 : MAX_FILE_BLOCKS;
+	} else {
+		nblocks = (inode->size+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	}
+
+	memcpy(blocks,inode->direct,sizeof(inode->direct));
+	nptrs = POINTERS_PER_INODE;
+
+	if(in_data(inode->indirect)) {
+		disk_read(inode->indirect,indirect.data);
+		memcpy(blocks+POINTERS_PER_INODE,indirect.pointers,sizeof(indirect.pointers));
+		nptrs = MAX_FILE_BLOCKS;
+	} else if(inode->indirect && nblocks>POINTERS_PER_INODE) {
+		if(loud) report(inumber,"has indirect block %d, outside the data area",inode->indirect);
+	} else if(inode->indirect) {
+		*stray = 1;
+	}
+
+	for(good=0;good<nblocks && good<nptrs;good++) {
+		if(!in_data(blocks[good])) {
+			if(!loud) break;
+			if(blocks[good]) report(inumber,"block %d of %d points to %d, outside the data area",good,nblocks,blocks[good]);
+			else report(inumber,"block %d of %d is missing",good,nblocks);
+			break;
+		}
+	}
+
+	if(good==nptrs && good<nblocks && !inode->indirect && loud) {
+		report(inumber,"has no indirect block for its %d blocks",nblocks);
+	}
+
+	for(i=nblocks;i<nptrs;i++) {
+		if(blocks[i]) *stray = 1;
+	}
+	if(nblocks<=POINTERS_PER_INODE && inode->indirect) *stray = 1;
+
+	if(*stray && loud) report(inumber,"points to blocks past its size of %d",inode->size);
+
+	return good;
+}
+
+/*
+Claim a block for inumber, keeping the lowest inumber as its owner.  The
+inode that ends up without it is reported and queued for repair.
+*/
+static void claim( int inumber, int blocknum )
+{
+	int old = __atomic_load_n(&owner[blocknum],__ATOMIC_RELAXED);
+
+	while(1) {
+		if(old && old<=inumber) {
+			__atomic_store_n(&shared[blocknum],1,__ATOMIC_RELAXED);
+			if(old==inumber) report(inumber,"points to block %d twice",blocknum);
+			else report(inumber,"shares block %d with inode %d",blocknum,old);
+			needs_fix(inumber);
+			return;
+		}
+		if(__atomic_compare_exchange_n(&owner[blocknum],&old,inumber,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+			if(old) {
+				__atomic_store_n(&shared[blocknum],1,__ATOMIC_RELAXED);
+				report(old,"shares block %d with inode %d",blocknum,inumber);
+				needs_fix(old);
+			}
+			return;
+		}
+	}
+}
+
+static void * scan_thread( void *arg )
+{
+	union fs_block *chunk = malloc(sizeof(union fs_block)*CHUNK_BLOCKS);
+	int blocks[MAX_FILE_BLOCKS];
+	long long files = 0, dirs = 0, data = 0, indirect = 0;
+	int first, n, i, j, k, good, stray;
+
+	while(1) {
+		first = __atomic_fetch_add(&next_chunk,CHUNK_BLOCKS,__ATOMIC_RELAXED);
+		if(first>super.ninodeblocks) break;
+
+		n = super.ninodeblocks-first+1;
+		if(n>CHUNK_BLOCKS) n = CHUNK_BLOCKS;
+		disk_read_extent(first,n,chunk[0].data);
+
+		for(i=0;i<n;i++) {
+			for(j=0;j<INODES_PER_BLOCK;j++) {
+				struct fs_inode *inode = &chunk[i].inode[j];
+				int inumber = (first+i-1)*INODES_PER_BLOCK+j;
+
+				if(!inode->isvalid) continue;
+
+				good = check_inode(inumber,inode,blocks,&stray,1);
+				if(good<0 || stray || inode->size<0 || inode->size>good*DISK_BLOCK_SIZE) {
+					needs_fix(inumber);
+				}
+				if(good<0) continue;
+
+				inuse[inumber] = inode->isvalid;
+				if(inode->isvalid==FS_INODE_DIR) dirs++;
+				else files++;
+
+				if(good>POINTERS_PER_INODE) {
+					claim(inumber,inode->indirect);
+					indirect++;
+				}
+				for(k=0;k<good;k++) claim(inumber,blocks[k]);
+				data += good;
+			}
+		}
+	}
+
+	__atomic_fetch_add(&nfiles,files,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&ndirs,dirs,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&ndata,data,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&nindirect,indirect,__ATOMIC_RELAXED);
+
+	free(chunk);
+	return 0;
+}
+
+/*
+Bring one damaged inode back in line: clear it, or cut it short before
+the first block it may not keep and zero every pointer past the new end.
+*/
+static void repair_inode( int inumber )
+{
+	union fs_block block, indirect;
+	struct fs_inode *inode;
+	int blocks[MAX_FILE_BLOCKS];
+	int good, stray, k, j;
+
+	disk_read(1+inumber/INODES_PER_BLOCK,block.data);
+	inode = &block.inode[inumber%INODES_PER_BLOCK];
+
+	good = check_inode(inumber,inode,blocks,&stray,0);
+
+	if(good<0) {
+		memset(inode,0,sizeof(*inode));
+		inuse[inumber] = 0;
+		disk_write(1+inumber/INODES_PER_BLOCK,block.data);
+		return;
+	}
+
+	if(good>POINTERS_PER_INODE && owner[inode->indirect]!=inumber) {
+		good = POINTERS_PER_INODE;
+	}
+
+	for(k=0;k<good;k++) {
+		if(owner[blocks[k]]!=inumber) break;
+		if(!shared[blocks[k]]) continue;
+		if(good>POINTERS_PER_INODE && blocks[k]==inode->indirect) break;
+		for(j=0;j<k && blocks[j]!=blocks[k];j++);
+		if(j<k) break;
+	}
+	good = k;
+
+	if(inode->size<0 || inode->size>good*DISK_BLOCK_SIZE) {
+		inode->size = good*DISK_BLOCK_SIZE;
+	}
+
+	for(k=good;k<POINTERS_PER_INODE;k++) inode->direct[k] = 0;
+
+	if(good>POINTERS_PER_INODE) {
+		memset(indirect.data,0,sizeof(indirect.data));
+		memcpy(indirect.pointers,blocks+POINTERS_PER_INODE,sizeof(int)*(good-POINTERS_PER_INODE));
+		disk_write(inode->indirect,indirect.data);
+	} else {
+		inode->indirect = 0;
+	}
+
+	disk_write(1+inumber/INODES_PER_BLOCK,block.data);
+}
+
+/*
+Every entry of a directory has to name an inode in use.  Returns the
+number of entries dropped, or that would be dropped without repair.
+*/
+static int check_dir( int inumber, int repair )
+{
+	union fs_block block, header, bucket;
+	int blocks[MAX_FILE_BLOCKS];
+	int good, stray, i, j, count = 0, dropped = 0, before;
+
+	disk_read(1+inumber/INODES_PER_BLOCK,block.data);
+	good = check_inode(inumber,&block.inode[inumber%INODES_PER_BLOCK],blocks,&stray,0);
+	if(good<1) {
+		report(inumber,"is a directory with no header block");
+		return 0;
+	}
+
+	disk_read(blocks[0],header.data);
+	if(header.dir.magic!=FS_DIR_MAGIC || header.dir.nbuckets<1 || header.dir.nbuckets>=good) {
+		report(inumber,"is a directory with a bad header");
+		return 0;
+	}
+
+	for(i=1;i<=header.dir.nbuckets;i++) {
+		disk_read(blocks[i],bucket.data);
+		if(bucket.bucket.count<0 || bucket.bucket.count>DIRENTS_PER_BUCKET) {
+			report(inumber,"has a bucket claiming %d entries",bucket.bucket.count);
+			continue;
+		}
+
+		before = dropped;
+		for(j=0;j<bucket.bucket.count;j++) {
+			struct fs_dirent *entry = &bucket.bucket.entry[j];
+			if(entry->inumber>0 && entry->inumber<super.ninodes && inuse[entry->inumber]) continue;
+
+			report(inumber,"has entry \"%.*s\" naming free inode %d",FS_NAME_MAX,entry->name,entry->inumber);
+			dropped++;
+			if(repair) {
+				*entry = bucket.bucket.entry[--bucket.bucket.count];
+				memset(&bucket.bucket.entry[bucket.bucket.count],0,sizeof(*entry));
+				j--;
+			}
+		}
+
+		if(repair && dropped>before) disk_write(blocks[i],bucket.data);
+		count += bucket.bucket.count;
+	}
+
+	if(header.dir.nentries!=count) {
+		if(!dropped) report(inumber,"counts %d entries but holds %d",header.dir.nentries,count);
+		if(repair) {
+			header.dir.nentries = count;
+			disk_write(blocks[0],header.data);
+		}
+	}
+
+	return dropped;
+}
+
+int main( int argc, char *argv[] )
+{
+	union fs_block block;
+	pthread_t *threads;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int repair = 0, stripe = DISK_STRIPE_DEFAULT, nfast = 0, mode, c, i, found;
+	long long start;
+
+	while((c = getopt(argc,argv,"yj:s:t:"))!=-1) {
+		switch(c) {
+			case 'y': repair = 1; break;
+			case 'j': nthreads = atoi(optarg); break;
+			case 's': stripe = atoi(optarg); break;
+			case 't': nfast = atoi(optarg); break;
+			default: argc = 0; break;
+		}
+	}
+
+	if(argc-optind!=2 || nthreads<1 || stripe<1 || nfast<0) {
+		printf("use: %s [-y] [-j <threads>] [-s <stripe blocks> | -t <fast blocks>] <diskfile>[,<diskfile>...] <nblocks>\n",argv[0]);
+		printf("    -y            repair what can be repaired\n");
+		printf("    -j <threads>  scan with this many threads (default: one per cpu)\n");
+		printf("    -s <blocks>   stripe unit the image was made with (default %d)\n",DISK_STRIPE_DEFAULT);
+		printf("    -t <blocks>   blocks on the fast file of a tiered <fastfile>,<slowfile> image\n");
+		return 8;
+	}
+
+	// never create or resize the image, and leave it alone unless repairing
+	mode = repair ? DISK_OPEN_EXISTING : DISK_OPEN_READONLY;
+	if(!disk_open(argv[optind],stripe,nfast,atoi(argv[optind+1]),mode)) {
+		if(errno==EFBIG) printf("%s holds fewer than %s blocks\n",argv[optind],argv[optind+1]);
+		else printf("couldn't open %s: %s\n",argv[optind],strerror(errno));
+		return 8;
+	}
+
+	start = stats_now();
+
+	disk_read(0,block.data);
+	super = block.super;
+
+	if(super.magic!=FS_MAGIC) {
+		printf("%s has no SimpleFS superblock\n",argv[optind]);
+		return 8;
+	}
+
+	// the superblock says how big the image is; <nblocks> only has to agree when the files are short
+	if(super.nblocks!=disk_size() && super.nblocks>0) {
+		disk_close();
+		if(disk_open(argv[optind],stripe,nfast,super.nblocks,mode)) {
+			printf("%s holds %d blocks, checking all of them\n",argv[optind],super.nblocks);
+		} else if(!disk_open(argv[optind],stripe,nfast,atoi(argv[optind+1]),mode)) {
+			printf("couldn't reopen %s: %s\n",argv[optind],strerror(errno));
+			return 8;
+		}
+	}
+
+	if(super.nblocks!=disk_size()) {
+		report(-1,"says %d blocks, the image holds %d",super.nblocks,disk_size());
+		if(super.nblocks>disk_size()) super.nblocks = disk_size();
+	}
+
+	if(super.ninodeblocks<1 || super.ninodeblocks>=super.nblocks) {
+		printf("superblock has %d inode blocks on a %d block disk, giving up\n",super.ninodeblocks,super.nblocks);
+		return 8;
+	}
+
+	if(super.ninodes!=super.ninodeblocks*INODES_PER_BLOCK) {
+		report(-1,"says %d inodes, the inode table holds %d",super.ninodes,super.ninodeblocks*INODES_PER_BLOCK);
+		super.ninodes = super.ninodeblocks*INODES_PER_BLOCK;
+	}
+
+	owner = calloc(super.nblocks,sizeof(int));
+	shared = calloc(super.nblocks,1);
+	inuse = calloc(super.ninodes,1);
+	threads = malloc(sizeof(pthread_t)*nthreads);
+
+	for(i=0;i<nthreads;i++) pthread_create(&threads[i],0,scan_thread,0);
+	for(i=0;i<nthreads;i++) pthread_join(threads[i],0);
+
+	if(repair && nfixes) {
+		qsort(fixes,nfixes,sizeof(int),compare_ints);
+		for(i=0;i<nfixes;i++) {
+			if(i==0 || fixes[i]!=fixes[i-1]) repair_inode(fixes[i]);
+		}
+	}
+
+	for(i=1;i<super.ninodes;i++) {
+		if(inuse[i]==FS_INODE_DIR) check_dir(i,repair);
+	}
+
+	if(super.root && (super.root<0 || super.root>=super.ninodes || inuse[super.root]!=FS_INODE_DIR)) {
+		report(-1,"root directory %d is not a directory; a new one is made at the next mount",super.root);
+		if(repair) {
+			disk_read(0,block.data);
+			block.super.root = 0;
+			disk_write(0,block.data);
+		}
+	}
+
+	if(repair && (block.super.nblocks!=super.nblocks || block.super.ninodes!=super.ninodes)) {
+		disk_read(0,block.data);
+		block.super.nblocks = super.nblocks;
+		block.super.ninodes = super.ninodes;
+		disk_write(0,block.data);
+	}
+
+	qsort(problems,nproblems,sizeof(*problems),compare_problems);
+	for(i=0;i<nproblems;i++) {
+		if(problems[i].inumber<0) printf("superblock %s\n",problems[i].text);
+		else printf("inode %d %s\n",problems[i].inumber,problems[i].text);
+	}
+
+	found = nproblems;
+	printf("%lld files, %lld directories, %lld data blocks, %lld indirect blocks\n",nfiles,ndirs,ndata,nindirect);
+	printf("%d problems %s in %.3f s with %d threads\n",found,found && repair ? "repaired" : "found",(stats_now()-start)/1e9,nthreads);
+
+	disk_close();
+
+	if(!found) return 0;
+	return repair ? 1 : 4;
+}
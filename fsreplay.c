@@ -0,0 +1,292 @@
+#include "fs.h"
+#include "disk.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/*
+fsreplay issues the calls recorded by "trace record" again, against a fresh
+or snapshot image, and reports how the replay fared next to the original.
+
+By default the fs calls are replayed.  Inumbers handed out by fs_create
+and fs_mkdirat during the trace are mapped onto the ones the replay gets
+back, so a trace taken on one image can be run on another.  With -b the raw block I/O is
+replayed instead, which overwrites whatever the blocks held: use a scratch
+copy of the image.
+*/
+
+#define NUM_OPS (DISK_TRACE_FS + FS_NUM_OPS)
+
+static const char *op_names[FS_NUM_OPS] = {
+	"mount", "create", "delete", "mkdir", "link", "unlink", "lookup", "truncate", "sync",
+	"read", "write", "fread", "fwrite", "copyin", "copyout"
+};
+
+static struct stats_hist recorded[NUM_OPS];
+static struct stats_hist replayed[NUM_OPS];
+
+static char *buffer = 0;
+static int buffer_size = 0;
+
+static int *inode_map = 0;
+static int ninodes = 0;
+
+static int copy_fd = -1;
+static int null_fd = -1;
+
+static const char *op_name( int op )
+{
+	if(op==DISK_TRACE_READ) return "block read";
+	if(op==DISK_TRACE_WRITE) return "block write";
+	return op_names[op-DISK_TRACE_FS];
+}
+
+static char * get_buffer( int length )
+{
+	if(length>buffer_size) {
+		free(buffer);
+		buffer = calloc(length,1);
+		buffer_size = buffer ? length : 0;
+	}
+	return buffer;
+}
+
+static int map_inode( int inumber )
+{
+	if(inumber>0 && inumber<ninodes) return inode_map[inumber];
+	return inumber;
+}
+
+/*
+Issue one block I/O record.  Returns the number of bytes moved, or -1 if
+the record falls outside the disk.
+*/
+static long long replay_block( const struct disk_trace *t )
+{
+	char *data;
+
+	if(t->nblocks<1 || t->blocknum<0 || t->blocknum+t->nblocks>disk_size()) return -1;
+
+	data = get_buffer(t->nblocks*DISK_BLOCK_SIZE);
+	if(!data) return -1;
+
+	if(t->op==DISK_TRACE_READ) {
+		if(t->nblocks==1) disk_read(t->blocknum,data);
+		else disk_read_extent(t->blocknum,t->nblocks,data);
+	} else {
+		if(t->nblocks==1) disk_write(t->blocknum,data);
+		else disk_write_extent(t->blocknum,t->nblocks,data);
+	}
+
+	return (long long)t->nblocks*DISK_BLOCK_SIZE;
+}
+
+/*
+The namespace calls return 0 when they fail; one that worked when it was
+traced and not now counts as failed.
+*/
+static long long outcome( const struct disk_trace *t, int result )
+{
+	return result==0 && t->result!=0 ? -1 : result;
+}
+
+/*
+Issue one fs call record.  Descriptor reads and writes are replayed by
+inumber at the offset the descriptor stood at.  Returns the call's result.
+*/
+static long long replay_call( const struct disk_trace *t )
+{
+	int inumber = map_inode(t->blocknum);
+	int result;
+	char *data;
+
+	switch(t->op-DISK_TRACE_FS) {
+		case FS_OP_MOUNT:
+			return 0; // the image was mounted before the replay began
+		case FS_OP_CREATE:
+			result = fs_create();
+			if(t->result>0 && t->result<ninodes) inode_map[t->result] = result;
+			return outcome(t,result);
+		case FS_OP_DELETE:
+			return outcome(t,fs_delete(inumber));
+		case FS_OP_MKDIR:
+			result = fs_mkdirat(inumber,t->name);
+			if(t->result>0 && t->result<ninodes) inode_map[t->result] = result;
+			return outcome(t,result);
+		case FS_OP_LINK:
+			return outcome(t,fs_linkat(inumber,t->name,map_inode(t->offset)));
+		case FS_OP_UNLINK:
+			return outcome(t,fs_unlinkat(inumber,t->name));
+		case FS_OP_LOOKUP:
+			return outcome(t,fs_lookupat(inumber,t->name));
+		case FS_OP_TRUNCATE:
+			return outcome(t,fs_truncate(inumber,t->nblocks));
+		case FS_OP_SYNC:
+			return fs_sync();
+		case FS_OP_READ:
+		case FS_OP_FREAD:
+			data = get_buffer(t->nblocks);
+			if(!data) return -1;
+			return fs_read(inumber,data,t->nblocks,t->offset);
+		case FS_OP_WRITE:
+		case FS_OP_FWRITE:
+			data = get_buffer(t->nblocks);
+			if(!data) return -1;
+			return fs_write(inumber,data,t->nblocks,t->offset);
+		case FS_OP_COPYIN:
+			return fs_copyin(inumber,copy_fd,t->nblocks);
+		case FS_OP_COPYOUT:
+			return fs_copyout(inumber,null_fd);
+	}
+
+	return -1;
+}
+
+static void wait_until( long long when )
+{
+	long long now = stats_now();
+	struct timespec ts;
+
+	if(when<=now) return;
+
+	ts.tv_sec = (when-now)/1000000000;
+	ts.tv_nsec = (when-now)%1000000000;
+	nanosleep(&ts,0);
+}
+
+int main( int argc, char *argv[] )
+{
+	struct disk_trace_header header;
+	struct disk_trace t;
+	FILE *file;
+	double speed = 1.0, elapsed;
+	int blocks = 0, format = 0, stripe = DISK_STRIPE_DEFAULT, nfast = 0, c, i;
+	long long first = -1, start, issued, result, lag, max_lag = 0;
+	long long nrecords = 0, nskipped = 0, nfailed = 0, bytes = 0;
+
+	while((c = getopt(argc,argv,"s:fbFS:t:"))!=-1) {
+		switch(c) {
+			case 's': speed = atof(optarg); break;
+			case 'f': speed = 0; break;
+			case 'b': blocks = 1; break;
+			case 'F': format = 1; break;
+			case 'S': stripe = atoi(optarg); break;
+			case 't': nfast = atoi(optarg); break;
+			default: argc = 0; break;
+		}
+	}
+
+	if(argc-optind!=3 || speed<0 || stripe<1 || nfast<0) {
+		printf("use: %s [-s <speed> | -f] [-b] [-F] [-S <stripe blocks> | -t <fast blocks>] <trace> <diskfile>[,<diskfile>...] <nblocks>\n",argv[0]);
+		printf("    -s <speed>  replay at speed times the original pace (default 1)\n");
+		printf("    -f          replay as fast as possible\n");
+		printf("    -b          replay block I/O rather than fs calls\n");
+		printf("    -F          format the image before replaying fs calls\n");
+		printf("    -S <blocks> stripe unit of a striped image (default %d)\n",DISK_STRIPE_DEFAULT);
+		printf("    -t <blocks> blocks on the fast file of a tiered <fastfile>,<slowfile> image\n");
+		return 1;
+	}
+
+	file = fopen(argv[optind],"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	if(fread(&header,sizeof(header),1,file)!=1 || memcmp(header.magic,DISK_TRACE_MAGIC,sizeof(header.magic))) {
+		printf("%s is not a trace file\n",argv[optind]);
+		return 1;
+	}
+
+	if(header.version!=DISK_TRACE_VERSION || header.record_size!=sizeof(struct disk_trace)) {
+		printf("%s is trace version %d, expected %d\n",argv[optind],header.version,DISK_TRACE_VERSION);
+		return 1;
+	}
+
+	if(nfast ? !disk_init_tiered(argv[optind+1],nfast,atoi(argv[optind+2])) : !disk_init_striped(argv[optind+1],stripe,atoi(argv[optind+2]))) {
+		printf("couldn't initialize %s: %s\n",argv[optind+1],strerror(errno));
+		return 1;
+	}
+
+	if(disk_size()<header.nblocks) {
+		printf("warning: trace was taken on a disk of %d blocks, replaying on %d\n",header.nblocks,disk_size());
+	}
+
+	if(!blocks) {
+		if(format && !fs_format()) {
+			printf("format failed!\n");
+			return 1;
+		}
+		if(!fs_mount()) {
+			printf("mount failed!\n");
+			return 1;
+		}
+
+		ninodes = fs_ninodes();
+		inode_map = malloc(sizeof(int)*ninodes);
+		for(i=0;i<ninodes;i++) inode_map[i] = i;
+
+		// copyin reads a sparse file of the largest possible length; copyout discards
+		copy_fd = fileno(tmpfile());
+		if(copy_fd<0 || ftruncate(copy_fd,(off_t)disk_size()*DISK_BLOCK_SIZE)<0) {
+			printf("couldn't create a copyin source: %s\n",strerror(errno));
+			return 1;
+		}
+		null_fd = open("/dev/null",O_WRONLY);
+	}
+
+	start = stats_now();
+
+	while(fread(&t,sizeof(t),1,file)==1) {
+		if(t.op<0 || t.op>=NUM_OPS || (t.op>=DISK_TRACE_FS)==blocks || (t.op>DISK_TRACE_WRITE && t.op<DISK_TRACE_FS)) {
+			continue;
+		}
+
+		if(first<0) first = t.time;
+
+		if(speed>0) {
+			wait_until(start+(long long)((t.time-first)/speed));
+			lag = stats_now()-start-(long long)((t.time-first)/speed);
+			if(lag>max_lag) max_lag = lag;
+		}
+
+		issued = stats_now();
+		result = blocks ? replay_block(&t) : replay_call(&t);
+		stats_record(&replayed[t.op],stats_now()-issued);
+		stats_record(&recorded[t.op],t.latency);
+		nrecords++;
+
+		if(result<0) {
+			if(blocks) nskipped++;
+			else nfailed++;
+		} else if(blocks || t.op-DISK_TRACE_FS>=FS_OP_READ) {
+			bytes += result;
+		}
+	}
+
+	elapsed = (stats_now()-start)/1e9;
+	fclose(file);
+
+	printf("replayed %lld records in %.3f s (%.0f ops/s)\n",nrecords,elapsed,elapsed>0 ? nrecords/elapsed : 0);
+	printf("%lld bytes (%.1f MB/s)\n",bytes,elapsed>0 ? bytes/elapsed/1e6 : 0);
+	if(speed>0) printf("at %gx the original pace, fell behind by at most %.3f ms\n",speed,max_lag/1e6);
+	if(nskipped) printf("%lld records fell outside the disk and were skipped\n",nskipped);
+	if(nfailed) printf("%lld calls failed\n",nfailed);
+
+	for(i=0;i<NUM_OPS;i++) {
+		if(!replayed[i].count) continue;
+		printf("%s:\n",op_name(i));
+		stats_print("recorded",&recorded[i]);
+		stats_print("replayed",&replayed[i]);
+	}
+
+	disk_close();
+
+	return 0;
+}
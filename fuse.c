@@ -0,0 +1,542 @@
+/*
+simplefs-fuse: mount a SimpleFS image through the FUSE low-level API.
+
+	simplefs-fuse [-t <fast blocks>] <diskfile> <nblocks> <mountpoint> [FUSE options]
+
+fs.c keeps all of its state in globals, so every call into it happens under
+fs_lock while the session loop serves requests on several threads.  Reads
+are answered with file-descriptor buffers pointing into the image, letting
+libfuse splice the data to the kernel instead of copying it through here.
+
+With -t the image is a tiered "fast,slow" pair, and a migrator thread takes
+fs_lock every MIGRATE_INTERVAL seconds to move blocks between the tiers.
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include "fs.h"
+#include "disk.h"
+#include "fs_layout.h"
+
+#include <fuse_lowlevel.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define MIGRATE_INTERVAL 10 // seconds between tiering passes
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static int root;
+
+/*
+The kernel insists the root is inode 1, but on older images the root
+directory was created later and inode 1 may be an ordinary file, so the
+two numbers are swapped.  Everything else maps straight through.
+*/
+static int to_inumber( fuse_ino_t ino )
+{
+	if(ino==FUSE_ROOT_ID) return root;
+	if((int)ino==root) return FUSE_ROOT_ID;
+	return ino;
+}
+
+static fuse_ino_t to_ino( int inumber )
+{
+	return to_inumber(inumber);
+}
+
+static int get_attr( int inumber, struct stat *st )
+{
+	int type, size;
+
+	type = fs_stat(inumber,&size);
+	if(!type) return 0;
+
+	memset(st,0,sizeof(*st));
+	st->st_ino = to_ino(inumber);
+	st->st_mode = fs_isdir(inumber) ? S_IFDIR|0755 : S_IFREG|0644;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blksize = DISK_BLOCK_SIZE;
+	st->st_blocks = (size+511)/512;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+
+	return 1;
+}
+
+static int get_entry( int inumber, struct fuse_entry_param *e )
+{
+	memset(e,0,sizeof(*e));
+	if(inumber<=0 || !get_attr(inumber,&e->attr)) return 0;
+
+	e->ino = e->attr.st_ino;
+	e->attr_timeout = 1.0;
+	e->entry_timeout = 1.0;
+
+	return 1;
+}
+
+static void sfs_init( void *userdata, struct fuse_conn_info *conn )
+{
+	if(conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+	if(conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if(conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void sfs_lookup( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	struct fuse_entry_param e;
+	int ok;
+
+	pthread_mutex_lock(&fs_lock);
+	ok = get_entry(fs_lookupat(to_inumber(parent),name),&e);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(ok) {
+		fuse_reply_entry(req,&e);
+	} else {
+		fuse_reply_err(req,ENOENT);
+	}
+}
+
+static void sfs_getattr( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	struct stat st;
+	int ok;
+
+	pthread_mutex_lock(&fs_lock);
+	ok = get_attr(to_inumber(ino),&st);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(ok) {
+		fuse_reply_attr(req,&st,1.0);
+	} else {
+		fuse_reply_err(req,ENOENT);
+	}
+}
+
+static void sfs_setattr( fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi )
+{
+	struct stat st;
+	int inumber = to_inumber(ino), err = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	if(!get_attr(inumber,&st)) err = ENOENT;
+	else if((to_set & FUSE_SET_ATTR_SIZE) && S_ISDIR(st.st_mode)) err = EISDIR;
+	else if((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size>(off_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) err = EFBIG;
+	else if((to_set & FUSE_SET_ATTR_SIZE) && !fs_truncate(inumber,attr->st_size)) err = ENOSPC;
+	else if(!get_attr(inumber,&st)) err = ENOENT;
+	pthread_mutex_unlock(&fs_lock);
+
+	if(!err) {
+		fuse_reply_attr(req,&st,1.0);
+	} else {
+		fuse_reply_err(req,err);
+	}
+}
+
+struct dirlist {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+static void add_entry( const char *name, int inumber, void *arg )
+{
+	struct dirlist *list = arg;
+	struct stat st;
+	size_t len;
+
+	memset(&st,0,sizeof(st));
+	st.st_ino = to_ino(inumber);
+
+	len = fuse_add_direntry(list->req,0,0,name,0,0);
+	if(list->used+len>list->size) {
+		list->size = 2*(list->used+len);
+		list->buf = realloc(list->buf,list->size);
+	}
+	fuse_add_direntry(list->req,list->buf+list->used,len,name,&st,list->used+len);
+	list->used += len;
+}
+
+static void sfs_readdir( fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	struct dirlist list = { req, 0, 0, 0 };
+	int result;
+
+	add_entry(".",to_inumber(ino),&list);
+	add_entry("..",to_inumber(ino),&list);
+
+	pthread_mutex_lock(&fs_lock);
+	result = fs_readdir(to_inumber(ino),add_entry,&list);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(result<0) {
+		fuse_reply_err(req,ENOTDIR);
+	} else if((size_t)off<list.used) {
+		fuse_reply_buf(req,list.buf+off,list.used-off<size ? list.used-off : size);
+	} else {
+		fuse_reply_buf(req,0,0);
+	}
+	free(list.buf);
+}
+
+static void sfs_open( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	int inumber = to_inumber(ino), ok = 1;
+
+	pthread_mutex_lock(&fs_lock);
+	if(fs_isdir(inumber)) {
+		ok = 0;
+	} else if(fi->flags & O_TRUNC) {
+		ok = fs_truncate(inumber,0);
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if(!ok) {
+		fuse_reply_err(req,EISDIR);
+		return;
+	}
+
+	fi->keep_cache = 1; // nothing changes the image behind the kernel's back
+	fuse_reply_open(req,fi);
+}
+
+/*
+Resolve the requested range to runs of contiguous blocks and hand libfuse
+one fd buffer per run.  fs_lock is held until the reply has been spliced,
+or another request could free and reuse the blocks in between.
+*/
+static void sfs_read( fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	struct fuse_bufvec *bufv;
+	int fd, filesize, blocknum, run, skip, n=0;
+	long long pos;
+	size_t bytes, done=0;
+
+	pthread_mutex_lock(&fs_lock);
+
+	fd = fs_open(to_inumber(ino));
+	if(fd<0) {
+		pthread_mutex_unlock(&fs_lock);
+		fuse_reply_err(req,ENOENT);
+		return;
+	}
+
+	fs_stat(to_inumber(ino),&filesize);
+	if(off>=filesize) size = 0;
+	else if(off+size>(size_t)filesize) size = filesize-off;
+
+	bufv = malloc(sizeof(*bufv)+(size/DISK_BLOCK_SIZE+2)*sizeof(struct fuse_buf));
+	memset(bufv,0,sizeof(*bufv));
+
+	while(done<size) {
+		skip = (off+done)%DISK_BLOCK_SIZE;
+		run = fs_fextent(fd,(off+done)/DISK_BLOCK_SIZE,&blocknum);
+		if(run<=0) break;
+
+		bufv->buf[n].flags = FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK;
+		bufv->buf[n].fd = disk_extent_fd(blocknum,&run,&pos); // may cut run at a stripe boundary
+
+		bytes = (size_t)run*DISK_BLOCK_SIZE-skip;
+		if(bytes>size-done) bytes = size-done;
+
+		bufv->buf[n].pos = pos+skip;
+		bufv->buf[n].size = bytes;
+		n++;
+		done += bytes;
+	}
+	bufv->count = n;
+
+	if(n) {
+		fuse_reply_data(req,bufv,FUSE_BUF_SPLICE_MOVE);
+	} else {
+		fuse_reply_buf(req,0,0);
+	}
+
+	fs_close(fd);
+	pthread_mutex_unlock(&fs_lock);
+	free(bufv);
+}
+
+static void sfs_write_buf( fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t off, struct fuse_file_info *fi )
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+	ssize_t size;
+	int fd, result=0;
+
+	buf.buf[0].mem = malloc(buf.buf[0].size);
+	size = fuse_buf_copy(&buf,in_buf,0);
+	if(size<0) {
+		free(buf.buf[0].mem);
+		fuse_reply_err(req,-size);
+		return;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+	fd = fs_open(to_inumber(ino));
+	if(fd>=0) {
+		fs_seek(fd,off);
+		result = fs_fwrite(fd,buf.buf[0].mem,size);
+		fs_close(fd);
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	free(buf.buf[0].mem);
+
+	if(fd<0) {
+		fuse_reply_err(req,ENOENT);
+	} else if(result<=0 && size>0) {
+		fuse_reply_err(req,ENOSPC);
+	} else {
+		fuse_reply_write(req,result);
+	}
+}
+
+static void sfs_create( fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi )
+{
+	struct fuse_entry_param e;
+	int inumber, ok;
+
+	pthread_mutex_lock(&fs_lock);
+	inumber = fs_create();
+	ok = inumber>0 && fs_linkat(to_inumber(parent),name,inumber);
+	if(inumber>0 && !ok) fs_delete(inumber);
+	ok = ok && get_entry(inumber,&e);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(!ok) {
+		fuse_reply_err(req,ENOSPC);
+		return;
+	}
+
+	fi->keep_cache = 1;
+	fuse_reply_create(req,&e,fi);
+}
+
+static void sfs_mkdir( fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode )
+{
+	struct fuse_entry_param e;
+	int ok;
+
+	pthread_mutex_lock(&fs_lock);
+	ok = get_entry(fs_mkdirat(to_inumber(parent),name),&e);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(ok) {
+		fuse_reply_entry(req,&e);
+	} else {
+		fuse_reply_err(req,EEXIST);
+	}
+}
+
+static int remove_entry( fuse_ino_t parent, const char *name, int dir ) // unlink or rmdir; returns an errno
+{
+	int inumber, err = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	inumber = fs_lookupat(to_inumber(parent),name);
+	if(!inumber) err = ENOENT;
+	else if(fs_isdir(inumber)!=dir) err = dir ? ENOTDIR : EISDIR;
+	else if(!fs_unlinkat(to_inumber(parent),name)) err = dir ? ENOTEMPTY : EIO;
+	pthread_mutex_unlock(&fs_lock);
+
+	return err;
+}
+
+static void sfs_unlink( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	fuse_reply_err(req,remove_entry(parent,name,0));
+}
+
+static void sfs_rmdir( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	fuse_reply_err(req,remove_entry(parent,name,1));
+}
+
+static void sfs_fsync( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi )
+{
+	pthread_mutex_lock(&fs_lock);
+	fs_sync();
+	pthread_mutex_unlock(&fs_lock);
+
+	fuse_reply_err(req,0);
+}
+
+static void * migrator( void *arg )
+{
+	while(1) {
+		sleep(MIGRATE_INTERVAL);
+		pthread_mutex_lock(&fs_lock);
+		fs_migrate(FS_MIGRATE_BUDGET);
+		pthread_mutex_unlock(&fs_lock);
+	}
+	return 0;
+}
+
+static void sfs_statfs( fuse_req_t req, fuse_ino_t ino )
+{
+	struct fs_statfs st;
+	struct statvfs sv;
+	int ok;
+
+	pthread_mutex_lock(&fs_lock);
+	ok = fs_statfs(&st);
+	pthread_mutex_unlock(&fs_lock);
+
+	if(!ok) {
+		fuse_reply_err(req,EIO);
+		return;
+	}
+
+	memset(&sv,0,sizeof(sv));
+	sv.f_bsize = DISK_BLOCK_SIZE;
+	sv.f_frsize = DISK_BLOCK_SIZE;
+	sv.f_blocks = st.nblocks;
+	sv.f_bfree = st.nfree;
+	sv.f_bavail = st.nfree;
+	sv.f_files = st.ninodes;
+	sv.f_ffree = st.nfreeinodes;
+	sv.f_favail = st.nfreeinodes;
+	sv.f_namemax = FS_NAME_MAX;
+	fuse_reply_statfs(req,&sv);
+}
+
+/*
+fuse_daemonize changes directory to /, so relative image names, including
+each name of a striped or tiered list, are anchored to the current
+directory before it runs.  Returns a malloc'd list.
+*/
+static char * absolute_images( const char *list )
+{
+	char cwd[4096], *result, *copy, *name, *save;
+	size_t size;
+
+	if(!getcwd(cwd,sizeof(cwd))) return 0;
+
+	size = strlen(list)+1;
+	for(name=(char*)list;name;name=strchr(name+1,',')) size += strlen(cwd)+1;
+
+	result = malloc(size);
+	copy = strdup(list);
+	result[0] = 0;
+	for(name=strtok_r(copy,",",&save);name;name=strtok_r(0,",",&save)) {
+		if(result[0]) strcat(result,",");
+		if(name[0]!='/') {
+			strcat(result,cwd);
+			strcat(result,"/");
+		}
+		strcat(result,name);
+	}
+	free(copy);
+
+	return result;
+}
+
+static const struct fuse_lowlevel_ops sfs_ops = {
+	.init      = sfs_init,
+	.lookup    = sfs_lookup,
+	.getattr   = sfs_getattr,
+	.setattr   = sfs_setattr,
+	.readdir   = sfs_readdir,
+	.open      = sfs_open,
+	.read      = sfs_read,
+	.write_buf = sfs_write_buf,
+	.create    = sfs_create,
+	.mkdir     = sfs_mkdir,
+	.unlink    = sfs_unlink,
+	.rmdir     = sfs_rmdir,
+	.fsync     = sfs_fsync,
+	.statfs    = sfs_statfs,
+};
+
+int main( int argc, char *argv[] )
+{
+	struct fuse_args args;
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	pthread_t thread;
+	char *name = argv[0], *image;
+	int result = 1, nfast = 0, nblocks, mounted = 0;
+
+	if(argc>2 && !strcmp(argv[1],"-t")) {
+		nfast = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+		argv[0] = name;
+	}
+
+	if(argc<4 || nfast<0) {
+		printf("use: %s [-t <fast blocks>] <diskfile> <nblocks> <mountpoint> [options]\n",argv[0]);
+		return 1;
+	}
+
+	// the disk is opened after fuse_daemonize, see below
+	image = absolute_images(argv[1]);
+	nblocks = atoi(argv[2]);
+	if(!image) {
+		printf("couldn't resolve %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+
+	// everything after the image arguments belongs to libfuse
+	argv[2] = argv[0];
+	args.argc = argc-2;
+	args.argv = argv+2;
+	args.allocated = 0;
+
+	if(fuse_parse_cmdline(&args,&opts)!=0) goto out;
+	if(!opts.mountpoint) {
+		printf("use: %s [-t <fast blocks>] <diskfile> <nblocks> <mountpoint> [options]\n",argv[0]);
+		goto out_args;
+	}
+
+	se = fuse_session_new(&args,&sfs_ops,sizeof(sfs_ops),0);
+	if(!se) goto out_args;
+
+	if(fuse_set_signal_handlers(se)==0) {
+		if(fuse_session_mount(se,opts.mountpoint)==0) {
+			fuse_daemonize(opts.foreground);
+			// only the calling thread survives the fork, so the disk's device and
+			// flusher threads and the migrator all have to start after it
+			if(nfast ? !disk_init_tiered(image,nfast,nblocks) : !disk_init(image,nblocks)) {
+				fprintf(stderr,"couldn't initialize %s: %s\n",image,strerror(errno));
+			} else if(!fs_mount() || !(root = fs_root())) {
+				fprintf(stderr,"mount failed!\n");
+				disk_close();
+			} else {
+				mounted = 1;
+				if(nfast) pthread_create(&thread,0,migrator,0);
+				if(opts.singlethread) {
+					result = fuse_session_loop(se);
+				} else {
+					result = fuse_session_loop_mt(se,opts.clone_fd);
+				}
+			}
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	fuse_session_destroy(se);
+
+out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+out:
+	if(mounted) {
+		pthread_mutex_lock(&fs_lock); // held from here on, so the migrator stays out
+		fs_sync();
+		disk_close();
+	}
+	free(image);
+	return result ? 1 : 0;
+}
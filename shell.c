@@ -5,9 +5,57 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_copyin_dir( const char *dirname, const char *path );
+static int do_ls( const char *path );
+static int lookup_inode( const char *arg, int create );
+static int do_copyout_all( const char *dirname );
+static int pool_start( int nthreads );
+static void pool_submit( int out, int inumber, const char *filename );
+static int pool_drain();
+static void pool_stop();
+static int pool_file( const char *filename );
+
+static long long bytes_copied = 0;
+static int copy_bufsize = 1<<20;
+
+/*
+In batch mode copies run on a pool of worker threads, so that reading and
+writing host files overlaps with the fs work of other copies.  The fs calls
+themselves stay serialized under fs_lock: a copy moves its file through
+memory, reading the host file before it takes the lock (copyin) or writing
+it after it lets go (copyout).  A copy is queued once its inode is known and
+waits for any earlier copy of the same inode; every other command waits for
+the pool to drain first, so a script ends the same as it would serially,
+though the messages of concurrent copies may come out in any order.
+*/
+#define POOL_QUEUE   64 // copies waiting for a worker
+#define POOL_THREADS 64
+
+struct copy_job {
+	int out;                // copyout rather than copyin
+	int inumber;
+	char filename[PATH_MAX];
+};
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;    // fs calls while the pool runs
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;  // everything pool_ below
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct copy_job pool_queue[POOL_QUEUE];
+static int pool_head=0, pool_count=0, pool_stopping=0, pool_ok=0;
+static int pool_current[POOL_THREADS];                         // inode each worker is copying, 0 if idle
+static pthread_t pool_threads[POOL_THREADS];
+static int pool_nthreads=0;
 
 int main( int argc, char *argv[] )
 {
@@ -16,30 +64,94 @@ int main( int argc, char *argv[] )
 	char arg1[1024];
 	char arg2[1024];
 	int inumber, result, args;
+	int batch = 0, ncommands = 0, c;
+	int stripe = DISK_STRIPE_DEFAULT, nfast = 0;
+	int mounted = 0, migrate_every = 0, nthreads = -1;
+	FILE *input = stdin;
+	struct timespec start, end, now, migrated;
+	double elapsed;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((c = getopt(argc,argv,"b:j:s:t:"))!=-1) {
+		switch(c) {
+			case 'b':
+				input = fopen(optarg,"r");
+				if(!input) {
+					printf("couldn't open %s: %s\n",optarg,strerror(errno));
+					return 1;
+				}
+				batch = 1;
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			case 's':
+				stripe = atoi(optarg);
+				break;
+			case 't':
+				nfast = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	if(argc-optind!=2 || stripe<1 || nfast<0 || nthreads>POOL_THREADS) {
+		printf("use: %s [-b <script>] [-j <threads>] [-s <stripe blocks>] <diskfile>[,<diskfile>...] <nblocks>\n",argv[0]);
+		printf("     %s [-b <script>] [-j <threads>] -t <fast blocks> <fastfile>,<slowfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
+	argv += optind-1;
+
+	// scripts fed through a pipe get batch mode too: no prompts, no per-line flush
+	if(!isatty(fileno(input))) batch = 1;
+	if(batch) setvbuf(stdout,0,_IOFBF,1<<16);
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(nfast ? !disk_init_tiered(argv[1],nfast,atoi(argv[2])) : !disk_init_striped(argv[1],stripe,atoi(argv[2]))) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
 	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
 
+	// batch copies go to a pool of workers, one per cpu unless -j says otherwise; -j 0 copies serially
+	if(batch) {
+		if(nthreads<0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(nthreads>POOL_THREADS) nthreads = POOL_THREADS;
+		pool_start(nthreads);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	migrated = start;
+
 	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+		if(!batch) {
+			printf(" simplefs> ");
+			fflush(stdout);
+		}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+		if(!fgets(line,sizeof(line),input)) break;
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+		if(line[0]=='\n' || line[0]=='#') continue;
+		line[strcspn(line,"\n")] = 0;
 
 		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+		if(args<=0) continue;
+		ncommands++;
+
+		// only copies run alongside the pool
+		if(strcmp(cmd,"copyin") && strcmp(cmd,"copyout")) pool_drain();
+
+		// with migrate auto, a tiering pass runs between commands once the interval is up
+		if(migrate_every && mounted) {
+			clock_gettime(CLOCK_MONOTONIC,&now);
+			if(now.tv_sec-migrated.tv_sec>=migrate_every) {
+				pthread_mutex_lock(&fs_lock);
+				fs_migrate(FS_MIGRATE_BUDGET);
+				pthread_mutex_unlock(&fs_lock);
+				migrated = now;
+			}
+		}
 
 		if(!strcmp(cmd,"format")) {
 			if(args==1) {
@@ -54,6 +166,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
 				if(fs_mount()) {
+					mounted = 1;
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -69,7 +182,7 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = lookup_inode(arg1,0);
 				result = fs_getsize(inumber);
 				if(result>=0) {
 					printf("inode %d has size %d\n",inumber,result);
@@ -77,7 +190,7 @@ int main( int argc, char *argv[] )
 					printf("getsize failed!\n");
 				}
 			} else {
-				printf("use: getsize <inumber>\n");
+				printf("use: getsize <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"create")) {
@@ -93,47 +206,240 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
+				if(arg1[0]=='/') {
+					result = fs_unlink(arg1);
+				} else {
+					inumber = atoi(arg1);
+					result = fs_delete(inumber);
+				}
+				if(result) {
+					printf("%s deleted.\n",arg1);
 				} else {
 					printf("delete failed!\n");
 				}
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("use: delete <inumber|path>\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = lookup_inode(arg1,0);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("use: cat <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
+			if(args==3 && pool_nthreads && pool_file(arg1)) {
+				pthread_mutex_lock(&fs_lock);
+				inumber = lookup_inode(arg2,1);
+				pthread_mutex_unlock(&fs_lock);
+				if(inumber>0) {
+					pool_submit(0,inumber,arg1);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else if(args==3) {
+				pool_drain();
+				inumber = lookup_inode(arg2,1);
+				if(inumber>0 && do_copyin(arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("use: copyin <filename> <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
+			if(args==3 && pool_nthreads && pool_file(arg2)) {
+				pthread_mutex_lock(&fs_lock);
+				inumber = lookup_inode(arg1,0);
+				pthread_mutex_unlock(&fs_lock);
+				if(inumber>0) {
+					pool_submit(1,inumber,arg2);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else if(args==3) {
+				pool_drain();
+				inumber = lookup_inode(arg1,0);
 				if(do_copyout(inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
+				printf("use: copyout <inumber|path> <filename>\n");
+			}
+
+		} else if(!strcmp(cmd,"mkdir")) {
+			if(args==2) {
+				inumber = fs_mkdir(arg1);
+				if(inumber>0) {
+					printf("created directory %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("mkdir failed!\n");
+				}
+			} else {
+				printf("use: mkdir <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"link")) {
+			if(args==3) {
+				inumber = atoi(arg2);
+				if(fs_link(arg1,inumber)) {
+					printf("linked %s to inode %d\n",arg1,inumber);
+				} else {
+					printf("link failed!\n");
+				}
+			} else {
+				printf("use: link <path> <inumber>\n");
+			}
+
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(arg1);
+				if(inumber>0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("lookup failed!\n");
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"ls")) {
+			if(args<=2) {
+				if(do_ls(args==2 ? arg1 : "/")<0) {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [<path>]\n");
+			}
+
+		} else if(!strcmp(cmd,"copyin-dir")) {
+			if(args==2 || args==3) {
+				result = do_copyin_dir(arg1,args==3 ? arg2 : 0);
+				if(result>=0) {
+					printf("copied %d files from %s\n",result,arg1);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else {
+				printf("use: copyin-dir <directory> [<path>]\n");
+			}
+
+		} else if(!strcmp(cmd,"copyout-all")) {
+			if(args==2) {
+				result = do_copyout_all(arg1);
+				if(result>=0) {
+					printf("copied %d inodes to %s\n",result,arg1);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else {
+				printf("use: copyout-all <directory>\n");
+			}
+
+		} else if(!strcmp(cmd,"bufsize")) {
+			if(args==2 && atoi(arg1)>0) {
+				copy_bufsize = atoi(arg1);
+				printf("copy buffer is %d bytes\n",copy_bufsize);
+			} else if(args==1) {
+				printf("copy buffer is %d bytes\n",copy_bufsize);
+			} else {
+				printf("use: bufsize [<bytes>]\n");
+			}
+
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				fs_sync();
+				printf("synced.\n");
+			} else {
+				printf("use: sync\n");
+			}
+
+		} else if(!strcmp(cmd,"writeback")) {
+			if(args>=2 && atoi(arg1)>=0) {
+				result = args==3 ? atoi(arg2) : DISK_QUEUE_DEADLINE;
+				disk_set_writeback(atoi(arg1),result);
+				if(atoi(arg1)) printf("queueing up to %d block writes for %d ms\n",atoi(arg1),result);
+				else printf("writing through\n");
+			} else {
+				printf("use: writeback <blocks> [<ms>]\n");
+			}
+
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==1) {
+				fs_defrag(FS_DEFRAG_FILES);
+			} else if(args==2 && !strcmp(arg1,"report")) {
+				fs_defrag(FS_DEFRAG_REPORT);
+			} else if(args==2 && !strcmp(arg1,"compact")) {
+				fs_defrag(FS_DEFRAG_COMPACT);
+			} else {
+				printf("use: defrag [report|compact]\n");
+			}
+
+		} else if(!strcmp(cmd,"migrate")) {
+			if(args==3 && !strcmp(arg1,"auto") && atoi(arg2)>=0) {
+				migrate_every = atoi(arg2);
+				if(migrate_every) printf("migrating between commands every %d s\n",migrate_every);
+				else printf("automatic migration off\n");
+			} else if(args<=2 && (args==1 || atoi(arg1)>0)) {
+				result = fs_migrate(args==2 ? atoi(arg1) : FS_MIGRATE_BUDGET);
+				if(result>=0) printf("moved %d blocks between tiers\n",result);
+			} else {
+				printf("use: migrate [<blocks>] | auto <seconds>\n");
+			}
+
+		} else if(!strcmp(cmd,"df")) {
+			if(args==1) {
+				struct fs_statfs st;
+				if(fs_statfs(&st)) {
+					printf("blocks: %d total, %d used, %d free (%.1f%% used)\n",st.nblocks,st.nblocks-st.nfree,st.nfree,st.nblocks ? 100.0*(st.nblocks-st.nfree)/st.nblocks : 0);
+					printf("inodes: %d total, %d used, %d free (%.1f%% used)\n",st.ninodes,st.ninodes-st.nfreeinodes,st.nfreeinodes,st.ninodes ? 100.0*(st.ninodes-st.nfreeinodes)/st.ninodes : 0);
+					printf("free space: %d extents, the largest %d blocks\n",st.freeExtents,st.largestFree);
+				}
+			} else {
+				printf("use: df\n");
+			}
+
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				fs_stats();
+				disk_stats();
+			} else {
+				printf("use: stats\n");
+			}
+
+		} else if(!strcmp(cmd,"trace")) {
+			if(args>=2 && !strcmp(arg1,"start")) {
+				result = args==3 ? atoi(arg2) : 65536;
+				if(result>0 && disk_trace_start(result)) {
+					printf("tracing the last %d block I/Os and fs calls\n",result);
+				} else {
+					printf("trace start failed!\n");
+				}
+			} else if(args==3 && !strcmp(arg1,"record")) {
+				if(disk_trace_open(arg2)) {
+					printf("recording every block I/O and fs call to %s\n",arg2);
+				} else {
+					printf("couldn't open %s: %s\n",arg2,strerror(errno));
+				}
+			} else if(args==3 && !strcmp(arg1,"dump")) {
+				result = disk_trace_dump(arg2);
+				if(result>=0) {
+					printf("wrote %d trace records to %s\n",result,arg2);
+				} else {
+					printf("trace dump failed!\n");
+				}
+			} else if(args==2 && !strcmp(arg1,"stop")) {
+				disk_trace_stop();
+				printf("tracing stopped\n");
+			} else {
+				printf("use: trace start [<records>] | record <file> | dump <file> | stop\n");
 			}
 
 		} else if(!strcmp(cmd,"help")) {
@@ -142,10 +448,24 @@ int main( int argc, char *argv[] )
 			printf("    mount\n");
 			printf("    debug\n");
 			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
+			printf("    delete  <inode|path>\n");
+			printf("    cat     <inode|path>\n");
+			printf("    copyin  <file> <inode|path>\n");
+			printf("    copyout <inode|path> <file>\n");
+			printf("    mkdir   <path>\n");
+			printf("    link    <path> <inode>\n");
+			printf("    lookup  <path>\n");
+			printf("    ls      [<path>]\n");
+			printf("    copyin-dir  <directory> [<path>]\n");
+			printf("    copyout-all <directory>\n");
+			printf("    bufsize [<bytes>]\n");
+			printf("    sync\n");
+			printf("    df\n");
+			printf("    writeback <blocks> [<ms>]\n");
+			printf("    defrag  [report|compact]\n");
+			printf("    migrate [<blocks>] | auto <seconds>\n");
+			printf("    stats\n");
+			printf("    trace start [<records>] | record <file> | dump <file> | stop\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -160,6 +480,19 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	pool_stop();
+
+	if(batch) {
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		elapsed = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+		printf("%d commands in %.3f seconds (%.1f commands/s)\n",ncommands,elapsed,elapsed>0 ? ncommands/elapsed : 0);
+		printf("%lld bytes copied (%.2f MB/s)\n",bytes_copied,elapsed>0 ? bytes_copied/elapsed/1e6 : 0);
+		printf("%d block I/Os (%.0f IOPS)\n",disk_nreads()+disk_nwrites(),elapsed>0 ? (disk_nreads()+disk_nwrites())/elapsed : 0);
+		if(input!=stdin) fclose(input);
+	}
+
+	if(mounted) fs_sync();
+
 	printf("closing emulated disk.\n");
 	disk_close();
 
@@ -169,8 +502,9 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	struct stat info;
+	int offset=0, result, actual, fd;
+	char *buffer;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -178,24 +512,44 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+	// regular files go straight from the host file into the image
+	if(fstat(fileno(file),&info)==0 && S_ISREG(info.st_mode) && info.st_size<=INT_MAX) {
+		offset = fs_copyin(inumber,fileno(file),info.st_size);
+		if(offset<0) {
+			fclose(file);
+			return 0;
+		}
+		if(offset!=info.st_size) {
+			printf("WARNING: fs_copyin only wrote %d bytes, not %d bytes\n",offset,(int)info.st_size);
+		}
+	} else {
+		fd = fs_open(inumber);
+		if(fd<0) {
+			fclose(file);
+			return 0;
+		}
+
+		buffer = malloc(copy_bufsize);
+		while(1) {
+			result = fread(buffer,1,copy_bufsize,file);
+			if(result<=0) break;
+			actual = fs_fwrite(fd,buffer,result);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_fwrite return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_fwrite only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
+		free(buffer);
+		fs_close(fd);
 	}
 
 	printf("%d bytes copied\n",offset);
+	bytes_copied += offset;
 
 	fclose(file);
 	return 1;
@@ -204,8 +558,7 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int result;
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -213,18 +566,310 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
-	while(1) {
-        //printf("offset size: %d\n", offset);
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-        //printf("result size: %d\n", result);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file); 
-		offset += result;
+	// the data bypasses stdio, so anything already buffered for stdout goes first
+	fflush(stdout);
+
+	result = fs_copyout(inumber,fileno(file));
+	if(result<0) {
+		fclose(file);
+		return 0;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%d bytes copied\n",result);
+	bytes_copied += result;
 
 	fclose(file);
 	return 1;
 }
 
+static int do_copyin_dir( const char *dirname, const char *fspath )
+{
+	struct dirent **names;
+	struct stat info;
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	int i, n, inumber, count=0, failed=0;
+
+	n = scandir(dirname,&names,0,alphasort);
+	if(n<0) {
+		printf("couldn't open %s: %s\n",dirname,strerror(errno));
+		return -1;
+	}
+
+	for(i=0;i<n;i++) {
+		snprintf(path,sizeof(path),"%s/%s",dirname,names[i]->d_name);
+		snprintf(target,sizeof(target),"%s/%s",fspath ? fspath : "",names[i]->d_name);
+		free(names[i]);
+
+		if(failed || stat(path,&info)<0 || !S_ISREG(info.st_mode)) continue;
+
+		pthread_mutex_lock(&fs_lock);
+		inumber = fs_create();
+		if(inumber>0 && fspath && !fs_link(target,inumber)) {
+			fs_delete(inumber);
+			inumber = -1;
+		}
+		pthread_mutex_unlock(&fs_lock);
+
+		if(inumber==0) {
+			printf("create failed!\n");
+			failed = 1;
+			continue;
+		}
+		if(inumber<0) continue;
+
+		if(pool_nthreads) {
+			pool_submit(0,inumber,path);
+		} else if(do_copyin(path,inumber)) {
+			printf("copied file %s to inode %d\n",path,inumber);
+			count++;
+		}
+	}
+
+	free(names);
+	return pool_nthreads ? pool_drain() : count;
+}
+
+static int do_copyout_all( const char *dirname )
+{
+	char path[PATH_MAX];
+	int inumber, ninodes, file, count=0;
+
+	if(mkdir(dirname,0777)<0 && errno!=EEXIST) {
+		printf("couldn't create %s: %s\n",dirname,strerror(errno));
+		return -1;
+	}
+
+	ninodes = fs_ninodes();
+
+	for(inumber=1;inumber<ninodes;inumber++) {
+		pthread_mutex_lock(&fs_lock);
+		file = fs_isvalid(inumber) && !fs_isdir(inumber); // directories are hash tables, not file data
+		pthread_mutex_unlock(&fs_lock);
+		if(!file) continue;
+
+		snprintf(path,sizeof(path),"%s/%d",dirname,inumber);
+		if(pool_nthreads) {
+			pool_submit(1,inumber,path);
+		} else if(do_copyout(inumber,path)) {
+			printf("copied inode %d to file %s\n",inumber,path);
+			count++;
+		}
+	}
+
+	return pool_nthreads ? pool_drain() : count;
+}
+
+static int lookup_inode( const char *arg, int create )
+{
+	int inumber;
+
+	if(arg[0]!='/') return atoi(arg);
+
+	inumber = fs_lookup(arg);
+	if(inumber>0 || !create) return inumber;
+
+	inumber = fs_create();
+	if(inumber>0 && !fs_link(arg,inumber)) {
+		fs_delete(inumber);
+		inumber = 0;
+	}
+	return inumber;
+}
+
+static void print_entry( const char *name, int inumber, void *arg )
+{
+	if(fs_isdir(inumber)) {
+		printf("%8d  %-28s  <dir>\n",inumber,name);
+	} else {
+		printf("%8d  %-28s  %d\n",inumber,name,fs_getsize(inumber));
+	}
+}
+
+static int do_ls( const char *path )
+{
+	int inumber = fs_lookup(path);
+
+	if(inumber<=0) return -1;
+
+	return fs_readdir(inumber,print_entry,0);
+}
+
+static int pool_file( const char *filename ) // a regular host file, or one yet to be made, can be copied in memory
+{
+	struct stat info;
+
+	return stat(filename,&info)<0 ? errno==ENOENT : S_ISREG(info.st_mode) && info.st_size<=INT_MAX;
+}
+
+static int copy_in( const struct copy_job *job )
+{
+	struct stat info;
+	char *data = 0;
+	int fd, length = 0, done = 0, result = -1;
+
+	fd = open(job->filename,O_RDONLY);
+	if(fd>=0 && fstat(fd,&info)==0) {
+		length = info.st_size;
+		data = malloc(length ? length : 1);
+		while(data && done<length && (result = read(fd,data+done,length-done))>0) done += result;
+	}
+	if(fd<0 || !data || done<length) {
+		printf("couldn't read %s: %s\n",job->filename,strerror(errno));
+		if(fd>=0) close(fd);
+		free(data);
+		return 0;
+	}
+	close(fd);
+
+	pthread_mutex_lock(&fs_lock);
+	result = length ? fs_write(job->inumber,data,length,0) : fs_isvalid(job->inumber)-1;
+	if(result>0) bytes_copied += result;
+	pthread_mutex_unlock(&fs_lock);
+	free(data);
+
+	flockfile(stdout);
+	if(result<0 || (length && result==0)) {
+		printf("copy failed!\n");
+	} else {
+		if(result!=length) printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",result,length);
+		printf("%d bytes copied\n",result);
+		printf("copied file %s to inode %d\n",job->filename,job->inumber);
+	}
+	funlockfile(stdout);
+
+	return result>=0 && !(length && result==0);
+}
+
+static int copy_out( const struct copy_job *job )
+{
+	char *data = 0;
+	int fd, length, done = 0, result = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	length = fs_getsize(job->inumber);
+	if(length>=0) data = malloc(length ? length : 1);
+	while(data && done<length && (result = fs_read(job->inumber,data+done,length-done,done))>0) done += result;
+	if(done>0) bytes_copied += done;
+	pthread_mutex_unlock(&fs_lock);
+
+	fd = data && done==length ? open(job->filename,O_WRONLY|O_CREAT|O_TRUNC,0666) : -1;
+	for(result=0;fd>=0 && result<done;) {
+		int n = write(fd,data+result,done-result);
+		if(n<=0) break;
+		result += n;
+	}
+	if(fd>=0) close(fd);
+	free(data);
+
+	flockfile(stdout);
+	if(fd<0 || result<done) {
+		if(fd<0 && data && done==length) printf("couldn't open %s: %s\n",job->filename,strerror(errno));
+		printf("copy failed!\n");
+	} else {
+		printf("%d bytes copied\n",done);
+		printf("copied inode %d to file %s\n",job->inumber,job->filename);
+	}
+	funlockfile(stdout);
+
+	return fd>=0 && result==done;
+}
+
+static void * pool_worker( void *arg )
+{
+	int *current = arg;
+	struct copy_job job;
+	int ok;
+
+	pthread_mutex_lock(&pool_lock);
+	while(1) {
+		while(!pool_count && !pool_stopping) pthread_cond_wait(&pool_work,&pool_lock);
+		if(!pool_count) break;
+
+		job = pool_queue[pool_head];
+		pool_head = (pool_head+1)%POOL_QUEUE;
+		pool_count--;
+		*current = job.inumber;
+		pthread_cond_broadcast(&pool_done);
+		pthread_mutex_unlock(&pool_lock);
+
+		ok = job.out ? copy_out(&job) : copy_in(&job);
+
+		pthread_mutex_lock(&pool_lock);
+		pool_ok += ok;
+		*current = 0;
+		pthread_cond_broadcast(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return 0;
+}
+
+static int pool_start( int nthreads )
+{
+	for(pool_nthreads=0;pool_nthreads<nthreads;pool_nthreads++) {
+		if(pthread_create(&pool_threads[pool_nthreads],0,pool_worker,&pool_current[pool_nthreads])) break;
+	}
+	return pool_nthreads;
+}
+
+static int pool_busy( int inumber ) // the caller holds pool_lock
+{
+	int i;
+
+	for(i=0;i<pool_count;i++) {
+		if(pool_queue[(pool_head+i)%POOL_QUEUE].inumber==inumber) return 1;
+	}
+	for(i=0;i<pool_nthreads;i++) {
+		if(pool_current[i]==inumber) return 1;
+	}
+	return 0;
+}
+
+static void pool_submit( int out, int inumber, const char *filename )
+{
+	struct copy_job *job;
+
+	pthread_mutex_lock(&pool_lock);
+	while(pool_count==POOL_QUEUE || pool_busy(inumber)) pthread_cond_wait(&pool_done,&pool_lock);
+
+	job = &pool_queue[(pool_head+pool_count)%POOL_QUEUE];
+	job->out = out;
+	job->inumber = inumber;
+	snprintf(job->filename,sizeof(job->filename),"%s",filename);
+	pool_count++;
+
+	pthread_cond_signal(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int pool_drain() // wait for every queued copy; returns how many worked since the last drain
+{
+	int i, ok;
+
+	pthread_mutex_lock(&pool_lock);
+	for(i=0;i<pool_nthreads;) {
+		if(pool_count || pool_current[i]) pthread_cond_wait(&pool_done,&pool_lock);
+		else i++;
+	}
+	ok = pool_ok;
+	pool_ok = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	return ok;
+}
+
+static void pool_stop()
+{
+	int i;
+
+	pool_drain();
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stopping = 1;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	for(i=0;i<pool_nthreads;i++) pthread_join(pool_threads[i],0);
+	pool_nthreads = 0;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+long long stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int bucket_of( long long ns )
+{
+	int e;
+
+	if(ns<STATS_SUB_BUCKETS) return ns<0 ? 0 : ns;
+
+	e = 63-__builtin_clzll(ns);
+	return (e-STATS_SUB_BITS+1)*STATS_SUB_BUCKETS + ((ns>>(e-STATS_SUB_BITS)) & (STATS_SUB_BUCKETS-1));
+}
+
+static long long bucket_top( int b ) // largest value that lands in bucket b
+{
+	int e = b/STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+
+	if(b<STATS_SUB_BUCKETS) return b;
+
+	return ((long long)(STATS_SUB_BUCKETS + b%STATS_SUB_BUCKETS + 1) << (e-STATS_SUB_BITS)) - 1;
+}
+
+void stats_record( struct stats_hist *h, long long ns )
+{
+	h->count++;
+	h->total += ns;
+	if(ns>h->max) h->max = ns;
+	h->bucket[bucket_of(ns)]++;
+}
+
+long long stats_percentile( const struct stats_hist *h, double p )
+{
+	long long want = h->count*p/100.0, seen = 0;
+	int b;
+
+	for(b=0;b<STATS_BUCKETS;b++) {
+		seen += h->bucket[b];
+		if(seen>want) return bucket_top(b)<h->max ? bucket_top(b) : h->max;
+	}
+
+	return h->max;
+}
+
+void stats_print( const char *name, const struct stats_hist *h )
+{
+	if(!h->count) {
+		printf("    %-10s no samples\n",name);
+		return;
+	}
+
+	printf("    %-10s avg %lld p50 %lld p90 %lld p99 %lld max %lld ns\n",name,
+		h->total/h->count,
+		stats_percentile(h,50),
+		stats_percentile(h,90),
+		stats_percentile(h,99),
+		h->max);
+}
@@ -0,0 +1,26 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+Log-linear latency histogram in the style of HDR histograms: each power of
+two of nanoseconds is split into STATS_SUB_BUCKETS linear steps, which keeps
+the relative error of any percentile under 1/STATS_SUB_BUCKETS.
+*/
+
+#define STATS_SUB_BITS    3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS     (64 * STATS_SUB_BUCKETS)
+
+struct stats_hist {
+	long long count;
+	long long total;
+	long long max;
+	long long bucket[STATS_BUCKETS];
+};
+
+long long stats_now();
+void      stats_record( struct stats_hist *h, long long ns );
+long long stats_percentile( const struct stats_hist *h, double p );
+void      stats_print( const char *name, const struct stats_hist *h );
+
+#endif